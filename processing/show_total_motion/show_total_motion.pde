@@ -4,32 +4,77 @@ import java.nio.channels.*;
 
 MappedByteBuffer mapping;
 
+// The buffer describes its own layout. We check the magic number and version,
+// then look up where the fields we want live instead of hard-coding them.
+final int MAGIC = 0x59445053;
+final int VERSION = 7;
+final int LAYOUT = 8;
+final int LAYOUT_TOTAL_MOTION_OFFSET = LAYOUT + 36;
+final int LAYOUT_TOTAL_MOTION_LOCK_OFFSET = LAYOUT + 40;
+final int LAYOUT_HEADER_SEGMENT_SIZE = LAYOUT + 56;
+
+int totalMotionOffset;
+int totalMotionLockOffset;
+
 void setup()
 {
   size(640, 480);
 
-  // The tracking buffer is a file on disk that, when we "map" it into memory,
+  // The tracking buffer is a file that, when we "map" it into memory,
   // allows us to access the same memory that the SpeedyEye app is writing to.
+  // On Linux, SpeedyEye's shared memory shows up as a file under /dev/shm.
+  // Elsewhere, run SpeedyEye with "--file" and save the buffer in our data folder.
+
+  File bufferFile = new File("/dev/shm/speedyeye-tracking-buffer");
+  if (!bufferFile.exists()) {
+    bufferFile = dataFile("tracking-buffer.bin");
+  }
+
+  // We only need the header segment, not the frame rings after it. Map enough
+  // to check the version and read the header size, then map exactly that.
 
   try {
-    FileChannel fc = new RandomAccessFile(dataFile("tracking-buffer.bin"), "rw").getChannel();
-    mapping = fc.map(FileChannel.MapMode.READ_WRITE, 0, fc.size());
+    FileChannel fc = new RandomAccessFile(bufferFile, "rw").getChannel();
+    mapping = fc.map(FileChannel.MapMode.READ_WRITE, 0, Math.min(fc.size(), 4096L));
+    mapping.order(ByteOrder.LITTLE_ENDIAN);
+
+    if (mapping.getInt(0) != MAGIC || mapping.getInt(4) != VERSION) {
+      println("Not a compatible tracking buffer. Is SpeedyEye running, and up to date?");
+      exit();
+      return;
+    }
+
+    mapping = fc.map(FileChannel.MapMode.READ_WRITE, 0, mapping.getLong(LAYOUT_HEADER_SEGMENT_SIZE));
     mapping.order(ByteOrder.LITTLE_ENDIAN);
   } catch (IOException e) {
     println(e);
     assert(false);
   }
+
+  totalMotionOffset = mapping.getInt(LAYOUT_TOTAL_MOTION_OFFSET);
+  totalMotionLockOffset = mapping.getInt(LAYOUT_TOTAL_MOTION_LOCK_OFFSET);
 }
 
 void draw()
 {
-  // Read the total motion from the buffer's header,
-  // and wrap around at the edges of the screen.
+  // Read the total motion from the buffer's header. Its sequence number
+  // is odd while SpeedyEye is updating the totals, and changes after each update,
+  // so we retry until we get an X and Y from the same update.
+
+  float rawX, rawY;
+  int seq;
+  do {
+    seq = mapping.getInt(totalMotionLockOffset);
+    rawX = mapping.getFloat(totalMotionOffset);
+    rawY = mapping.getFloat(totalMotionOffset + 4);
+  } while ((seq & 1) != 0 || seq != mapping.getInt(totalMotionLockOffset));
+
+  // Wrap around at the edges of the screen.
 
-  float totalX = mapping.getFloat(0) % width;
+  float totalX = rawX % width;
   if (totalX < 0) totalX += width;
 
-  float totalY = mapping.getFloat(4) % height;
+  float totalY = rawY % height;
   if (totalY < 0) totalY += height;
 
   clear();
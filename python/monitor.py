@@ -0,0 +1,20 @@
+#!/usr/bin/env python
+# Show how far behind each registered tracking buffer client is, once a second.
+# Usage: monitor.py [shared memory name]
+
+import sys
+import time
+import speedyeye
+
+buf = speedyeye.Buffer(sys.argv[1] if len(sys.argv) > 1 else None)
+print('Ring depth %d frames' % buf.num_frames)
+
+while True:
+    print('\n%-16s %8s %8s %12s %10s %10s %10s' % (
+        'client', 'pid', 'lag', 'dropped', 'latency', 'max', 'idle'))
+    for c in buf.clients():
+        print('%-16s %8d %8d %12d %8.1fms %8.1fms %8.1fs%s' % (
+            c['name'], c['owner'], c['lag'], c['frames_dropped'],
+            c['latency_us'] / 1e3, c['max_latency_us'] / 1e3, c['idle_ns'] / 1e9,
+            '  DEAD' if c['dead'] else ''))
+    time.sleep(1)
@@ -0,0 +1,36 @@
+# Build with: python setup.py build_ext --inplace
+#
+# Needs NumPy and the Boost headers. If Boost isn't installed system-wide, point BOOST_ROOT
+# at a copy, such as the one in Cinder's boost directory.
+
+import os
+import sys
+import numpy
+from setuptools import setup, Extension
+
+here = os.path.dirname(os.path.abspath(__file__))
+src = os.path.join(here, '..', 'src')
+
+include_dirs = [src, numpy.get_include()]
+if 'BOOST_ROOT' in os.environ:
+    include_dirs.append(os.environ['BOOST_ROOT'])
+
+if sys.platform == 'win32':
+    compile_args = ['/EHsc']
+    libraries = []
+else:
+    compile_args = ['-std=c++11', '-fvisibility=hidden']
+    libraries = ['rt'] if sys.platform.startswith('linux') else []
+
+setup(
+    name='speedyeye',
+    version='0.1',
+    description='Zero-copy access to a SpeedyEye tracking buffer',
+    ext_modules=[Extension(
+        'speedyeye',
+        sources=[os.path.join(here, 'speedyeyemodule.cpp'), os.path.join(src, 'speedyeye.cpp')],
+        include_dirs=include_dirs,
+        extra_compile_args=compile_args,
+        libraries=libraries,
+    )],
+)
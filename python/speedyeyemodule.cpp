@@ -0,0 +1,579 @@
+// Python bindings for SpeedyEye tracking buffer clients (c) 2015 Micah Elizabeth Scott
+// MIT license
+//
+// Built on the C interface in speedyeye.h. Frame arrays are read-only NumPy views of the
+// shared ring, kept alive by a reference to the Buffer they came from. VideoDecoder
+// arrays are new copies.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+#include <stdlib.h>
+#include "speedyeye.h"
+
+static PyObject *ReadError;
+
+typedef struct {
+    PyObject_HEAD
+    speedyeye_client *client;
+} Buffer;
+
+static int Buffer_init(Buffer *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "name", "file", NULL };
+    const char *name = NULL;
+    const char *file = NULL;
+    char error[256] = "";
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zz", (char**) kwlist, &name, &file)) {
+        return -1;
+    }
+
+    // Arrays from this buffer point into its mapping, so it has to outlive them
+    if (self->client) {
+        PyErr_SetString(PyExc_ValueError, "Buffer is already open");
+        return -1;
+    }
+
+    self->client = file ? speedyeye_open_file(file, error, sizeof error)
+                        : speedyeye_open(name, error, sizeof error);
+    if (!self->client) {
+        PyErr_SetString(PyExc_OSError, error);
+        return -1;
+    }
+    return 0;
+}
+
+static void Buffer_dealloc(Buffer *self)
+{
+    speedyeye_close(self->client);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+// Methods need a buffer that was opened successfully
+static bool checkOpen(Buffer *self)
+{
+    if (!self->client) {
+        PyErr_SetString(PyExc_ValueError, "Buffer is not open");
+        return false;
+    }
+    return true;
+}
+
+// Read-only array over shared memory, holding a reference to the buffer
+static PyObject *sharedArray(Buffer *self, int type, int nd, npy_intp *dims, const void *data)
+{
+    PyObject *array = PyArray_New(&PyArray_Type, nd, dims, type, NULL, (void*) data, 0,
+                                  NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED, NULL);
+    if (!array) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    if (PyArray_SetBaseObject((PyArrayObject*) array, (PyObject*) self) < 0) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    return array;
+}
+
+static int setItem(PyObject *dict, const char *key, PyObject *value)
+{
+    if (!value) {
+        return -1;
+    }
+    int result = PyDict_SetItemString(dict, key, value);
+    Py_DECREF(value);
+    return result;
+}
+
+static PyObject *Buffer_frame(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    PyObject *indexArg = Py_None;
+    if (!PyArg_ParseTuple(args, "|O", &indexArg)) {
+        return NULL;
+    }
+
+    // Default to the latest published frame. Before the first one, ask for frame zero so
+    // the error is not-ready rather than an overrun from the counter wrapping.
+    uint32_t index;
+    if (indexArg == Py_None) {
+        uint32_t counter = speedyeye_frame_counter(self->client);
+        index = counter ? counter - 1 : 0;
+    } else {
+        index = (uint32_t) PyLong_AsUnsignedLongMask(indexArg);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    speedyeye_frame frame;
+    int result = speedyeye_get_frame(self->client, index, &frame);
+    if (result != SPEEDYEYE_READ_OK) {
+        PyErr_SetObject(ReadError, Py_BuildValue("(iI)", result, index));
+        return NULL;
+    }
+
+    PyObject *dict = PyDict_New();
+    if (!dict) {
+        return NULL;
+    }
+
+    npy_intp n = frame.num_points;
+    npy_intp full[3] = { frame.height, frame.width, 4 };
+    npy_intp half[3] = { frame.height / 2, frame.width / 2, 4 };
+    npy_intp quarter[3] = { frame.height / 4, frame.width / 4, 4 };
+
+    if (setItem(dict, "frame_index", PyLong_FromUnsignedLong(frame.frame_index))
+        || setItem(dict, "timestamp", PyFloat_FromDouble(frame.timestamp))
+        || setItem(dict, "timestamp_ns", PyLong_FromLongLong(frame.timestamp_ns))
+        || setItem(dict, "motion", Py_BuildValue("(ff)", frame.motion_x, frame.motion_y))
+        || setItem(dict, "num_points", PyLong_FromUnsignedLong(frame.num_points))
+        || setItem(dict, "x", sharedArray(self, NPY_FLOAT32, 1, &n, frame.x))
+        || setItem(dict, "y", sharedArray(self, NPY_FLOAT32, 1, &n, frame.y))
+        || setItem(dict, "dx", sharedArray(self, NPY_FLOAT32, 1, &n, frame.dx))
+        || setItem(dict, "dy", sharedArray(self, NPY_FLOAT32, 1, &n, frame.dy))
+        || setItem(dict, "weight", sharedArray(self, NPY_FLOAT32, 1, &n, frame.weight))
+        || setItem(dict, "age", sharedArray(self, NPY_UINT32, 1, &n, frame.age))
+        || setItem(dict, "link", sharedArray(self, NPY_UINT32, 1, &n, frame.link))
+        || setItem(dict, "id", sharedArray(self, NPY_UINT64, 1, &n, frame.id))
+        || setItem(dict, "pixels", sharedArray(self, NPY_UINT8, 3, full, frame.pixels))
+        || setItem(dict, "pixels_half", sharedArray(self, NPY_UINT8, 3, half, frame.pixels_half))
+        || setItem(dict, "pixels_quarter", sharedArray(self, NPY_UINT8, 3, quarter, frame.pixels_quarter))
+        || setItem(dict, "_frame", PyBytes_FromStringAndSize((const char*) &frame, sizeof frame))) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+static PyObject *Buffer_valid(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    PyObject *dict;
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &dict)) {
+        return NULL;
+    }
+
+    PyObject *bytes = PyDict_GetItemString(dict, "_frame");
+    if (!bytes || !PyBytes_Check(bytes) || PyBytes_GET_SIZE(bytes) != sizeof(speedyeye_frame)) {
+        PyErr_SetString(PyExc_ValueError, "Not a frame from Buffer.frame()");
+        return NULL;
+    }
+
+    speedyeye_frame frame;
+    memcpy(&frame, PyBytes_AS_STRING(bytes), sizeof frame);
+    return PyBool_FromLong(speedyeye_frame_valid(&frame));
+}
+
+static PyObject *Buffer_wait(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    unsigned long index;
+    double timeout = 1.0;
+    if (!PyArg_ParseTuple(args, "k|d", &index, &timeout)) {
+        return NULL;
+    }
+
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = speedyeye_wait_for_frame(self->client, (uint32_t) index, timeout);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(ok);
+}
+
+// Structured dtypes matching the C history structs
+static PyArray_Descr *structDescr(PyObject *names, PyObject *formats, PyObject *offsets, size_t itemsize)
+{
+    PyArray_Descr *descr = NULL;
+    PyObject *spec = Py_BuildValue("{sOsOsOsn}", "names", names, "formats", formats,
+                                   "offsets", offsets, "itemsize", (Py_ssize_t) itemsize);
+    if (spec) {
+        PyArray_DescrConverter(spec, &descr);
+        Py_DECREF(spec);
+    }
+    return descr;
+}
+
+static PyArray_Descr *historyFrameDescr()
+{
+    PyObject *names = Py_BuildValue("[ssssssss]", "frame_index", "status", "timestamp", "timestamp_ns",
+                                    "motion_x", "motion_y", "num_points", "first_point");
+    PyObject *formats = Py_BuildValue("[ssssssss]", "u4", "i4", "f8", "i8", "f4", "f4", "u4", "u8");
+    PyObject *offsets = Py_BuildValue("[nnnnnnnn]",
+        (Py_ssize_t) offsetof(speedyeye_history_frame, frame_index),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, status),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, timestamp),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, timestamp_ns),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, motion_x),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, motion_y),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, num_points),
+        (Py_ssize_t) offsetof(speedyeye_history_frame, first_point));
+    PyArray_Descr *descr = NULL;
+    if (names && formats && offsets) {
+        descr = structDescr(names, formats, offsets, sizeof(speedyeye_history_frame));
+    }
+    Py_XDECREF(names);
+    Py_XDECREF(formats);
+    Py_XDECREF(offsets);
+    return descr;
+}
+
+static PyArray_Descr *historyPointDescr()
+{
+    PyObject *names = Py_BuildValue("[sss]", "id", "x", "y");
+    PyObject *formats = Py_BuildValue("[sss]", "u8", "f4", "f4");
+    PyObject *offsets = Py_BuildValue("[nnn]",
+        (Py_ssize_t) offsetof(speedyeye_history_point, id),
+        (Py_ssize_t) offsetof(speedyeye_history_point, x),
+        (Py_ssize_t) offsetof(speedyeye_history_point, y));
+    PyArray_Descr *descr = NULL;
+    if (names && formats && offsets) {
+        descr = structDescr(names, formats, offsets, sizeof(speedyeye_history_point));
+    }
+    Py_XDECREF(names);
+    Py_XDECREF(formats);
+    Py_XDECREF(offsets);
+    return descr;
+}
+
+// New array owning a copy of count structs
+static PyObject *copiedArray(PyArray_Descr *descr, npy_intp count, const void *data)
+{
+    PyObject *array = PyArray_NewFromDescr(&PyArray_Type, descr, 1, &count, NULL, NULL, 0, NULL);
+    if (array && count) {
+        memcpy(PyArray_DATA((PyArrayObject*) array), data, count * PyArray_ITEMSIZE((PyArrayObject*) array));
+    }
+    return array;
+}
+
+static PyObject *Buffer_history(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    unsigned long first, count;
+    if (!PyArg_ParseTuple(args, "kk", &first, &count)) {
+        return NULL;
+    }
+
+    // Start with room for one full frame, which guarantees progress, and grow geometrically
+    // as frames come in. Reserving for the worst case up front would be gigabytes for a
+    // long history.
+    uint64_t maxPoints = speedyeye_max_points(self->client);
+    uint64_t capacity = maxPoints;
+    speedyeye_history_frame *frames = (speedyeye_history_frame*) malloc(sizeof *frames * (count ? count : 1));
+    speedyeye_history_point *points = (speedyeye_history_point*) malloc(sizeof *points * (capacity ? capacity : 1));
+    uint32_t done = 0;
+    uint64_t used = 0;
+
+    while (frames && points && done < count) {
+        uint64_t added = 0;
+        uint32_t n;
+        Py_BEGIN_ALLOW_THREADS
+        n = speedyeye_read_history(self->client, (uint32_t) (first + done), (uint32_t) (count - done),
+                                   frames + done, points + used, capacity - used, &added);
+        Py_END_ALLOW_THREADS
+
+        for (uint32_t i = done; i < done + n; i++) {
+            frames[i].first_point += used;
+        }
+        done += n;
+        used += added;
+        if (done == count) {
+            break;
+        }
+
+        // Stopped short: either the next frame isn't published yet, or its points didn't fit
+        uint32_t next = (uint32_t) (first + done);
+        if ((int32_t) (next - speedyeye_frame_counter(self->client)) >= 0) {
+            break;
+        }
+        capacity = capacity * 2 > used + maxPoints ? capacity * 2 : used + maxPoints;
+        speedyeye_history_point *grown = (speedyeye_history_point*) realloc(points, sizeof *points * capacity);
+        if (!grown) {
+            free(points);
+        }
+        points = grown;
+    }
+
+    PyObject *result = NULL;
+    if (frames && points) {
+        PyArray_Descr *frameDescr = historyFrameDescr();
+        PyArray_Descr *pointDescr = historyPointDescr();
+        PyObject *frameArray = frameDescr ? copiedArray(frameDescr, done, frames) : NULL;
+        PyObject *pointArray = pointDescr ? copiedArray(pointDescr, (npy_intp) used, points) : NULL;
+        if (frameArray && pointArray) {
+            result = PyTuple_Pack(2, frameArray, pointArray);
+        }
+        Py_XDECREF(frameArray);
+        Py_XDECREF(pointArray);
+    } else {
+        PyErr_NoMemory();
+    }
+
+    free(frames);
+    free(points);
+    return result;
+}
+
+static PyObject *Buffer_register(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    return PyBool_FromLong(speedyeye_register(self->client, name));
+}
+
+static PyObject *Buffer_report(Buffer *self, PyObject *args)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    unsigned long next;
+    unsigned long long consumed, dropped;
+    long long timestamp_ns = 0;
+    if (!PyArg_ParseTuple(args, "kKK|L", &next, &consumed, &dropped, &timestamp_ns)) {
+        return NULL;
+    }
+    return PyBool_FromLong(speedyeye_report(self->client, (uint32_t) next, consumed, dropped, timestamp_ns));
+}
+
+static PyObject *Buffer_clients(Buffer *self, PyObject *)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    speedyeye_client_stats stats[64];
+    uint32_t n = speedyeye_read_clients(self->client, stats, 64);
+
+    PyObject *list = PyList_New(0);
+    for (uint32_t i = 0; list && i < n; i++) {
+        PyObject *item = Py_BuildValue("{sIsssIsKsKsIsIsLsO}",
+            "owner", stats[i].owner,
+            "name", stats[i].name,
+            "lag", stats[i].lag,
+            "frames_consumed", (unsigned long long) stats[i].frames_consumed,
+            "frames_dropped", (unsigned long long) stats[i].frames_dropped,
+            "latency_us", stats[i].latency_us,
+            "max_latency_us", stats[i].max_latency_us,
+            "idle_ns", (long long) stats[i].idle_ns,
+            "dead", stats[i].dead ? Py_True : Py_False);
+        if (!item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+static PyObject *Buffer_get_frame_counter(Buffer *self, void *)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(speedyeye_frame_counter(self->client));
+}
+
+static PyObject *Buffer_get_num_frames(Buffer *self, void *)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(speedyeye_num_frames(self->client));
+}
+
+static PyObject *Buffer_get_num_history_frames(Buffer *self, void *)
+{
+    if (!checkOpen(self)) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(speedyeye_num_history_frames(self->client));
+}
+
+static PyMethodDef Buffer_methods[] = {
+    { "frame", (PyCFunction) Buffer_frame, METH_VARARGS,
+      "frame([index]) -> dict of a published frame, the latest by default, with NumPy views\n"
+      "of its points and images in shared memory. Raises ReadError(status, index) if the\n"
+      "frame isn't available." },
+    { "valid", (PyCFunction) Buffer_valid, METH_VARARGS,
+      "valid(frame) -> True if nothing read from the frame's arrays so far has been overwritten" },
+    { "wait", (PyCFunction) Buffer_wait, METH_VARARGS,
+      "wait(index[, timeout]) -> True once the frame with this index is published, or False\n"
+      "after timeout seconds" },
+    { "history", (PyCFunction) Buffer_history, METH_VARARGS,
+      "history(first, count) -> (frames, points) structured arrays copied from the history ring.\n"
+      "Each frame's points are points[first_point : first_point + num_points]." },
+    { "register", (PyCFunction) Buffer_register, METH_VARARGS,
+      "register(name) -> True if this process joined the buffer's client registry" },
+    { "report", (PyCFunction) Buffer_report, METH_VARARGS,
+      "report(next_frame, consumed, dropped[, timestamp_ns]) -> publish our progress to the registry.\n"
+      "timestamp_ns is the capture time of the last frame read, for latency." },
+    { "clients", (PyCFunction) Buffer_clients, METH_NOARGS,
+      "clients() -> list of dicts describing every registered client" },
+    { NULL }
+};
+
+static PyGetSetDef Buffer_getset[] = {
+    { (char*) "frame_counter", (getter) Buffer_get_frame_counter, NULL, (char*) "Frames published so far", NULL },
+    { (char*) "num_frames", (getter) Buffer_get_num_frames, NULL, (char*) "Depth of the frame ring", NULL },
+    { (char*) "num_history_frames", (getter) Buffer_get_num_history_frames, NULL, (char*) "Depth of the history ring", NULL },
+    { NULL }
+};
+
+static PyTypeObject BufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+typedef struct {
+    PyObject_HEAD
+    speedyeye_video_decoder *decoder;
+    int format;
+    unsigned width, height;
+} VideoDecoder;
+
+static int VideoDecoder_init(VideoDecoder *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "format", "width", "height", NULL };
+    int format;
+    unsigned width, height;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iII", (char**) kwlist, &format, &width, &height)) {
+        return -1;
+    }
+
+    speedyeye_video_decoder_free(self->decoder);
+    self->decoder = speedyeye_video_decoder_new(format, width, height);
+    if (!self->decoder) {
+        PyErr_SetString(PyExc_ValueError, "Unsupported video format or size");
+        return -1;
+    }
+    self->format = format;
+    self->width = width;
+    self->height = height;
+    return 0;
+}
+
+static void VideoDecoder_dealloc(VideoDecoder *self)
+{
+    speedyeye_video_decoder_free(self->decoder);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject *VideoDecoder_decode(VideoDecoder *self, PyObject *args)
+{
+    Py_buffer header, payload;
+    if (!self->decoder) {
+        PyErr_SetString(PyExc_ValueError, "VideoDecoder is not initialized");
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "y*y*", &header, &payload)) {
+        return NULL;
+    }
+
+    PyObject *array = NULL;
+    if (header.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Frame header must be 32 bytes");
+    } else {
+        npy_intp dims[3] = { self->height, self->width, 2 };
+        int nd = self->format == SPEEDYEYE_VIDEO_YUV422 ? 3 : 2;
+        array = PyArray_SimpleNew(nd, dims, NPY_UINT8);
+        if (array) {
+            int ok;
+            Py_BEGIN_ALLOW_THREADS
+            ok = speedyeye_video_decode(self->decoder, header.buf, payload.buf, payload.len,
+                                        (uint8_t*) PyArray_DATA((PyArrayObject*) array));
+            Py_END_ALLOW_THREADS
+            if (!ok) {
+                Py_DECREF(array);
+                array = NULL;
+                PyErr_SetString(PyExc_ValueError, "Corrupt video frame, or waiting for a keyframe");
+            }
+        }
+    }
+
+    PyBuffer_Release(&header);
+    PyBuffer_Release(&payload);
+    return array;
+}
+
+static PyMethodDef VideoDecoder_methods[] = {
+    { "decode", (PyCFunction) VideoDecoder_decode, METH_VARARGS,
+      "decode(header, payload) -> image array from one frame of the stream: height x width\n"
+      "luminance, or height x width x 2 packed YUYV. Frames must be decoded in order." },
+    { NULL }
+};
+
+static PyTypeObject VideoDecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static struct PyModuleDef speedyeyeModule = {
+    PyModuleDef_HEAD_INIT,
+    "speedyeye",
+    "Zero-copy access to a SpeedyEye tracking buffer",
+    -1,
+};
+
+PyMODINIT_FUNC PyInit_speedyeye(void)
+{
+    import_array();
+
+    BufferType.tp_name = "speedyeye.Buffer";
+    BufferType.tp_basicsize = sizeof(Buffer);
+    BufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+    BufferType.tp_doc = "Buffer(name=None, file=None): map a tracking buffer from shared memory or a file";
+    BufferType.tp_new = PyType_GenericNew;
+    BufferType.tp_init = (initproc) Buffer_init;
+    BufferType.tp_dealloc = (destructor) Buffer_dealloc;
+    BufferType.tp_methods = Buffer_methods;
+    BufferType.tp_getset = Buffer_getset;
+    if (PyType_Ready(&BufferType) < 0) {
+        return NULL;
+    }
+
+    VideoDecoderType.tp_name = "speedyeye.VideoDecoder";
+    VideoDecoderType.tp_basicsize = sizeof(VideoDecoder);
+    VideoDecoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+    VideoDecoderType.tp_doc = "VideoDecoder(format, width, height): decode a stream from SpeedyEye's video server";
+    VideoDecoderType.tp_new = PyType_GenericNew;
+    VideoDecoderType.tp_init = (initproc) VideoDecoder_init;
+    VideoDecoderType.tp_dealloc = (destructor) VideoDecoder_dealloc;
+    VideoDecoderType.tp_methods = VideoDecoder_methods;
+    if (PyType_Ready(&VideoDecoderType) < 0) {
+        return NULL;
+    }
+
+    PyObject *module = PyModule_Create(&speedyeyeModule);
+    if (!module) {
+        return NULL;
+    }
+
+    ReadError = PyErr_NewException("speedyeye.ReadError", NULL, NULL);
+    Py_INCREF(ReadError);
+    Py_INCREF(&BufferType);
+    PyModule_AddObject(module, "ReadError", ReadError);
+    PyModule_AddObject(module, "Buffer", (PyObject*) &BufferType);
+    Py_INCREF(&VideoDecoderType);
+    PyModule_AddObject(module, "VideoDecoder", (PyObject*) &VideoDecoderType);
+    PyModule_AddIntConstant(module, "READ_OK", SPEEDYEYE_READ_OK);
+    PyModule_AddIntConstant(module, "READ_NOT_READY", SPEEDYEYE_READ_NOT_READY);
+    PyModule_AddIntConstant(module, "READ_OVERRUN", SPEEDYEYE_READ_OVERRUN);
+    PyModule_AddIntConstant(module, "READ_BUSY", SPEEDYEYE_READ_BUSY);
+    PyModule_AddIntConstant(module, "VIDEO_LUMA", SPEEDYEYE_VIDEO_LUMA);
+    PyModule_AddIntConstant(module, "VIDEO_YUV422", SPEEDYEYE_VIDEO_YUV422);
+    return module;
+}
@@ -0,0 +1,39 @@
+#!/usr/bin/env python
+# Receive SpeedyEye's binary UDP stream and print the motion of each frame, counting
+# packets lost along the way. Run SpeedyEye with --udp 127.0.0.1:9000 to try it locally.
+# Usage: udp_receive.py [port [multicast group]]
+
+import socket
+import struct
+import sys
+
+HEADER = struct.Struct('<IHHIIqd')
+MOTION = struct.Struct('<ffffI')
+MAGIC = 0x55445053
+MOTION_PACKET = 1
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 9000
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.bind(('', port))
+if len(sys.argv) > 2:
+    group = socket.inet_aton(sys.argv[2])
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, group + socket.inet_aton('0.0.0.0'))
+
+expected = None
+lost = 0
+
+while True:
+    data = sock.recv(2048)
+    magic, version, kind, sequence, frame, timestamp_ns, timestamp = HEADER.unpack_from(data)
+    if magic != MAGIC or version != 1:
+        continue
+
+    if expected is not None and sequence != expected:
+        lost += (sequence - expected) & 0xFFFFFFFF
+    expected = (sequence + 1) & 0xFFFFFFFF
+
+    if kind == MOTION_PACKET:
+        mx, my, tx, ty, num_points = MOTION.unpack_from(data, HEADER.size)
+        print('frame %8d  %10.4fs  motion %7.2f %7.2f  total %9.1f %9.1f  %4d points  %d lost' % (
+            frame, timestamp, mx, my, tx, ty, num_points, lost))
@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+# Watch the live video from SpeedyEye's --video server. Shows it with OpenCV if that's
+# installed, and prints the frame rate, bandwidth, and skipped frames once a second.
+# Usage: video_receive.py [host [port]]
+
+import socket
+import struct
+import sys
+import time
+import speedyeye
+
+try:
+    import cv2
+except ImportError:
+    cv2 = None
+
+STREAM_HEADER = struct.Struct('<IHHHHI')
+FRAME_HEADER = struct.Struct('<IIqdHHI')
+MAGIC = 0x56445053
+
+
+def recv_exactly(sock, size):
+    data = bytearray()
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            sys.exit('Server closed the connection')
+        data += chunk
+    return bytes(data)
+
+
+host = sys.argv[1] if len(sys.argv) > 1 else '127.0.0.1'
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 9100
+sock = socket.create_connection((host, port))
+sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+magic, version, format, width, height, _ = STREAM_HEADER.unpack(recv_exactly(sock, STREAM_HEADER.size))
+if magic != MAGIC or version != 1:
+    sys.exit('Not a SpeedyEye video stream')
+decoder = speedyeye.VideoDecoder(format, width, height)
+print('%dx%d %s' % (width, height, 'YUV 4:2:2' if format == speedyeye.VIDEO_YUV422 else 'luminance'))
+
+frames = skipped = received = 0
+last_report = time.time()
+
+while True:
+    header = recv_exactly(sock, FRAME_HEADER.size)
+    payload_size, frame_index, timestamp_ns, timestamp, flags, _, frame_skipped = FRAME_HEADER.unpack(header)
+    payload = recv_exactly(sock, payload_size)
+    image = decoder.decode(header, payload)
+    raw_size = image.nbytes
+
+    # Acknowledge, so the server knows it can send another
+    sock.sendall(struct.pack('<I', frame_index))
+
+    frames += 1
+    skipped += frame_skipped
+    received += FRAME_HEADER.size + payload_size
+
+    if cv2:
+        if format == speedyeye.VIDEO_YUV422:
+            image = cv2.cvtColor(image, cv2.COLOR_YUV2BGR_YUYV)
+        cv2.imshow('SpeedyEye', image)
+        if cv2.waitKey(1) == 27:
+            break
+
+    now = time.time()
+    if now - last_report >= 1.0:
+        print('frame %8d  %6.1f fps  %7.1f kB/s  %5.1fx compression  %d skipped' % (
+            frame_index, frames / (now - last_report), received / 1e3 / (now - last_report),
+            frames * raw_size / max(received, 1), skipped))
+        frames = skipped = received = 0
+        last_report = now
@@ -4,12 +4,16 @@
 #include "cinder/gl/Texture.h"
 #include "cinder/Utilities.h"
 #include "cinder/Thread.h"
+#include "cinder/ImageIo.h"
 #include <mutex>
 
 #include "yuv422.h"
+#include "clock.h"
 #include "ps3eye.h"
 #include "TrackingBuffer.h"
 #include "TrackingView.h"
+#include "UdpPublisher.h"
+#include "VideoServer.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -31,9 +35,10 @@ public:
 private:
     params::InterfaceGlRef  mParams;
     PS3EYECam::PS3EYERef    mEye;
-    fs::path                mTrackingBufferPath;
     TrackingBuffer          mTrackingBuffer;
     TrackingView            mTrackingView;
+    UdpPublisher            mUdpPublisher;
+    VideoServer             mVideoServer;
     thread                  mThread;
     bool                    mExiting;
 	bool                    mInitialized;
@@ -41,11 +46,33 @@ private:
     float                   mTrackingTime;
     float                   mMaxTrackingTime;
     int                     mCurrentNumPoints;
+    uint32_t                mControlsGeneration;
+    uint32_t                mFirstFrame;
+    double                  mLastClockUpdate;
+    double                  mLastClientUpdate;
+    int                     mNumClients;
+    int                     mMaxClientLag;
+    int                     mClientLatency;
+    int                     mVideoViewers;
+    bool                    mResetPoints;
     string                  mErrorString;
 	mutex                   mErrorMutex;
+    vector<uint32_t>        mSnapshotFrames;
+    mutex                   mSnapshotMutex;
+
+    // GUI's copy of the controls, refreshed whenever the producer changes them
+    TrackingBuffer::ControlValues_t mGuiControls;
     
     void captureFrame();
     void newTrackingPoint();
+    void applyControls();
+    double runCommand(const TrackingBuffer::Command_t &command);
+    void updateGuiControls();
+    void updateClock();
+    void updateClients();
+    void saveSnapshots();
+    bool parseArgs(TrackingBuffer::Options &options, UdpPublisher::Options &udpOptions,
+                   VideoServer::Options &videoOptions);
 };
 
 
@@ -67,13 +94,35 @@ void SpeedyEyeApp::setup()
     mCurrentNumPoints = 0;
     mTrackingTime = 0.0f;
     mMaxTrackingTime = 0.9f;
+    mResetPoints = false;
+    mLastClockUpdate = -1;
+    mLastClientUpdate = -1;
+    mNumClients = 0;
+    mMaxClientLag = 0;
+    mClientLatency = 0;
+    mVideoViewers = 0;
+
+    TrackingBuffer::Options bufferOptions;
+    UdpPublisher::Options udpOptions;
+    VideoServer::Options videoOptions;
+    if (!parseArgs(bufferOptions, udpOptions, videoOptions)) {
+        mErrorString = "Unrecognized command line options";
+        return;
+    }
 
-    mTrackingBufferPath = getSaveFilePath("tracking-buffer.bin");
-
-    if (!mTrackingBuffer.open(mTrackingBufferPath.string().c_str())) {
-        mErrorString = "Failed to create tracking buffer file";
+    bool opened = mTrackingBuffer.open(bufferOptions);
+    for (auto& warning : mTrackingBuffer.warnings()) {
+        console() << warning << endl;
+    }
+    if (!opened) {
+        mErrorString = "Failed to create tracking buffer";
         return;
     }
+
+    mFirstFrame = mTrackingBuffer.header().status.frame_counter;
+    if (mTrackingBuffer.attached()) {
+        console() << "Continuing existing buffer at frame " << mFirstFrame << endl;
+    }
     
     std::vector<PS3EYECam::PS3EYERef> devices(PS3EYECam::getDevices());
     if (!devices.size()) {
@@ -88,6 +137,21 @@ void SpeedyEyeApp::setup()
         return;
     }
 
+    // The buffer and the conversion kernel are sized for one mode; make sure we got it
+    if (mEye->getWidth() != TrackingBuffer::kWidth || mEye->getHeight() != TrackingBuffer::kHeight) {
+        mErrorString = "Camera didn't accept the requested video mode";
+        return;
+    }
+
+    if (!udpOptions.destinations.empty() && !mUdpPublisher.start(mTrackingBuffer, udpOptions)) {
+        mErrorString = "Can't start UDP publisher: " + mUdpPublisher.error();
+        return;
+    }
+    if (videoOptions.port && !mVideoServer.start(mTrackingBuffer, videoOptions)) {
+        mErrorString = "Can't start video server: " + mVideoServer.error();
+        return;
+    }
+
     mTrackingView.setup();
 
     mThread = thread(bind(&SpeedyEyeApp::threadFn, this));
@@ -98,30 +162,137 @@ void SpeedyEyeApp::setup()
     mParams->addParam("Tracking points", &mCurrentNumPoints, "readonly=true");
     mParams->addParam("Tracking time", &mTrackingTime, "readonly=true");
     mParams->addParam("Max tracking time", &mMaxTrackingTime).min(0.f).max(1.f).step(0.01f);
+    mParams->addParam("Clients", &mNumClients, "readonly=true");
+    mParams->addParam("Slowest client lag", &mMaxClientLag, "readonly=true");
+    mParams->addParam("Client latency (us)", &mClientLatency, "readonly=true");
+    mParams->addParam("Video viewers", &mVideoViewers, "readonly=true");
+    // The GUI edits its own copy of the controls, and sends each change through the
+    // command queue like any other client would
+    mControlsGeneration = mTrackingBuffer.header().controls.generation - 1;
+    updateGuiControls();
+
+    auto set = [this] (TrackingBuffer::ControlId id) {
+        return [this, id] {
+            mTrackingBuffer.postCommand(TrackingBuffer::kCommandSetControl, id, mGuiControls.get(id));
+        };
+    };
+
     mParams->addSeparator();
-    mParams->addParam("Flip H", (bool*)&mTrackingBuffer.data()->header.camera_flip_h);
-    mParams->addParam("Flip V", (bool*)&mTrackingBuffer.data()->header.camera_flip_v);
-    mParams->addParam("Tracking point quality", &mTrackingBuffer.data()->header.min_point_quality).min(0.001f).max(1.f).step(0.001f);
+    mParams->addParam("Flip H", (bool*)&mGuiControls.camera_flip_h).updateFn(set(TrackingBuffer::kControlFlipH));
+    mParams->addParam("Flip V", (bool*)&mGuiControls.camera_flip_v).updateFn(set(TrackingBuffer::kControlFlipV));
+    mParams->addParam("Tracking point quality", &mGuiControls.min_point_quality).min(0.001f).max(1.f).step(0.001f).updateFn(set(TrackingBuffer::kControlMinPointQuality));
     mParams->addSeparator();
-    mParams->addParam("Auto gain", (bool*)&mTrackingBuffer.data()->header.camera_autogain);
-    mParams->addParam("Gain", &mTrackingBuffer.data()->header.camera_gain).min(0).max(255);
-    mParams->addParam("Exposure", &mTrackingBuffer.data()->header.camera_exposure).min(0).max(255);
-    mParams->addParam("Sharpness", &mTrackingBuffer.data()->header.camera_sharpness).min(0).max(255);
-    mParams->addParam("Brightness", &mTrackingBuffer.data()->header.camera_brightness).min(0).max(255);
-    mParams->addParam("Contrast", &mTrackingBuffer.data()->header.camera_contrast).min(0).max(255);
+    mParams->addParam("Auto gain", (bool*)&mGuiControls.camera_autogain).updateFn(set(TrackingBuffer::kControlAutogain));
+    mParams->addParam("Gain", &mGuiControls.camera_gain).min(0).max(255).updateFn(set(TrackingBuffer::kControlGain));
+    mParams->addParam("Exposure", &mGuiControls.camera_exposure).min(0).max(255).updateFn(set(TrackingBuffer::kControlExposure));
+    mParams->addParam("Sharpness", &mGuiControls.camera_sharpness).min(0).max(255).updateFn(set(TrackingBuffer::kControlSharpness));
+    mParams->addParam("Brightness", &mGuiControls.camera_brightness).min(0).max(255).updateFn(set(TrackingBuffer::kControlBrightness));
+    mParams->addParam("Contrast", &mGuiControls.camera_contrast).min(0).max(255).updateFn(set(TrackingBuffer::kControlContrast));
     mParams->addSeparator();
-    mParams->addParam("Auto white balance", (bool*)&mTrackingBuffer.data()->header.camera_awb);
-    mParams->addParam("Blue balance", &mTrackingBuffer.data()->header.camera_blueblc).min(0).max(255);
-    mParams->addParam("Red balance", &mTrackingBuffer.data()->header.camera_redblc).min(0).max(255);
-    mParams->addParam("Hue", &mTrackingBuffer.data()->header.camera_hue).min(0).max(255);
+    mParams->addParam("Auto white balance", (bool*)&mGuiControls.camera_awb).updateFn(set(TrackingBuffer::kControlAutoWhiteBalance));
+    mParams->addParam("Blue balance", &mGuiControls.camera_blueblc).min(0).max(255).updateFn(set(TrackingBuffer::kControlBlueBalance));
+    mParams->addParam("Red balance", &mGuiControls.camera_redblc).min(0).max(255).updateFn(set(TrackingBuffer::kControlRedBalance));
+    mParams->addParam("Hue", &mGuiControls.camera_hue).min(0).max(255).updateFn(set(TrackingBuffer::kControlHue));
+    mParams->addSeparator();
+    mParams->addButton("Reset motion", [this] { mTrackingBuffer.postCommand(TrackingBuffer::kCommandResetMotion); });
+    mParams->addButton("Reset points", [this] { mTrackingBuffer.postCommand(TrackingBuffer::kCommandResetPoints); });
+    mParams->addButton("Snapshot", [this] { mTrackingBuffer.postCommand(TrackingBuffer::kCommandSnapshot); });
 
 	mInitialized = true;
 }
 
+bool SpeedyEyeApp::parseArgs(TrackingBuffer::Options &options, UdpPublisher::Options &udpOptions,
+                             VideoServer::Options &videoOptions)
+{
+    // Command line options:
+    //
+    //   --file [path]      Keep the tracking buffer in a disk file instead of shared memory.
+    //                      Useful for looking at the last frames after a crash. If no path
+    //                      is given, we ask for one.
+    //   --name <name>      Name of the shared memory object
+    //   --huge-pages       Back the buffer with transparent huge pages, where supported
+    //   --no-prefault      Don't touch every page of the buffer at startup
+    //   --mlock            Lock the buffer into RAM
+    //   --fresh            Always start a new buffer, instead of continuing a compatible one
+    //   --frames <n>       Depth of the frame ring, from 8 to 8192 (rounded up to a power of two)
+    //   --history <n>      Depth of the points and motion history ring, from 8 to 1048576
+    //   --udp <host:port>  Send motion, the motion field, and points to this address in
+    //                      our binary format. Unicast or multicast; may be repeated.
+    //   --osc <host:port>  Same, as OSC messages
+    //   --udp-every <n>    Only send every nth frame over UDP and OSC
+    //   --udp-points <n>   Most tracking points to send per frame, zero for none
+    //   --udp-ttl <n>      Multicast hop limit
+    //   --video [port]     Serve compressed live video over TCP, for python/video_receive.py
+    //   --video-luma       Only send luminance, for half the bandwidth
+    //   --video-every <n>  Send at most every nth frame to each viewer
+
+    const vector<string>& args = getArgs();
+
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        bool hasValue = i + 1 < args.size() && args[i + 1].compare(0, 2, "--") != 0;
+
+        if (arg == "--file") {
+            options.backing = TrackingBuffer::Options::kFile;
+            if (hasValue) {
+                options.name = args[++i];
+            } else {
+                options.name = getSaveFilePath("tracking-buffer.bin").string();
+                if (options.name.empty()) {
+                    return false;
+                }
+            }
+        } else if (arg == "--name" && hasValue) {
+            options.name = args[++i];
+        } else if (arg == "--huge-pages") {
+            options.huge_pages = true;
+        } else if (arg == "--no-prefault") {
+            options.prefault = false;
+        } else if (arg == "--mlock") {
+            options.lock_memory = true;
+        } else if (arg == "--fresh") {
+            options.attach = false;
+        } else if (arg == "--frames" && hasValue) {
+            options.num_frames = atoi(args[++i].c_str());
+        } else if (arg == "--history" && hasValue) {
+            options.history_frames = atoi(args[++i].c_str());
+        } else if ((arg == "--udp" || arg == "--osc") && hasValue) {
+            UdpPublisher::Destination dest;
+            UdpPublisher::Format format = arg == "--osc" ? UdpPublisher::kOsc : UdpPublisher::kBinary;
+            if (!UdpPublisher::parseDestination(args[++i], format, dest)) {
+                console() << "Expected host:port after " << arg << endl;
+                return false;
+            }
+            udpOptions.destinations.push_back(dest);
+        } else if (arg == "--udp-every" && hasValue) {
+            udpOptions.decimation = atoi(args[++i].c_str());
+        } else if (arg == "--udp-points" && hasValue) {
+            udpOptions.max_points = min<unsigned>(atoi(args[++i].c_str()), TrackingBuffer::kMaxTrackingPoints);
+        } else if (arg == "--udp-ttl" && hasValue) {
+            udpOptions.ttl = atoi(args[++i].c_str());
+        } else if (arg == "--video") {
+            videoOptions.port = hasValue ? uint16_t(atoi(args[++i].c_str())) : VideoServer::kDefaultPort;
+        } else if (arg == "--video-luma") {
+            videoOptions.format = VideoCodec::kFormatLuma;
+        } else if (arg == "--video-every" && hasValue) {
+            videoOptions.decimation = atoi(args[++i].c_str());
+        } else {
+            console() << "Unrecognized option: " << arg << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void SpeedyEyeApp::threadFn()
 {
     mEye->start();
 
+    // Start the camera with whatever settings the buffer has, and publish what it accepted
+    applyControls();
+    mTrackingBuffer.header().controls.changed();
+
 	while (!mExiting) {
         if (!PS3EYECam::updateDevices()) {
 			lock_guard<mutex> lock(mErrorMutex);
@@ -129,37 +300,172 @@ void SpeedyEyeApp::threadFn()
             break;
         }
 
-        #define CAMERA_PARAM(field, getter, setter) \
-            if (mEye->getter() != mTrackingBuffer.data()->header.field) { \
-                mEye->setter(mTrackingBuffer.data()->header.field); \
-                mTrackingBuffer.data()->header.field = mEye->getter(); \
+        if (mEye->isNewFrame()) {
+            // Commands take effect between frames; with nothing queued this is one load
+            mTrackingBuffer.drainCommands([this] (const TrackingBuffer::Command_t &command) {
+                return runCommand(command);
+            });
+            captureFrame();
+        }
+    }
+
+    mEye->stop();
+}
+
+double SpeedyEyeApp::runCommand(const TrackingBuffer::Command_t &command)
+{
+    auto& header = mTrackingBuffer.header();
+
+    switch (command.type) {
+
+        case TrackingBuffer::kCommandSetControl:
+            if (command.param >= TrackingBuffer::kNumControls) {
+                return -1;
             }
-    
-        CAMERA_PARAM(camera_autogain, getAutogain, setAutogain);
-        CAMERA_PARAM(camera_gain, getGain, setGain);
-        CAMERA_PARAM(camera_exposure, getExposure, setExposure);
-        CAMERA_PARAM(camera_sharpness, getSharpness, setSharpness);
-        CAMERA_PARAM(camera_hue, getHue, setHue);
-        CAMERA_PARAM(camera_awb, getHue, setHue);
-        CAMERA_PARAM(camera_brightness, getBrightness, setBrightness);
-        CAMERA_PARAM(camera_contrast, getContrast, setContrast);
-        CAMERA_PARAM(camera_blueblc, getBlueBalance, setBlueBalance);
-        CAMERA_PARAM(camera_redblc, getRedBalance, setRedBalance);
-
-        if (mEye->getFlipH() != mTrackingBuffer.data()->header.camera_flip_h ||
-            mEye->getFlipV() != mTrackingBuffer.data()->header.camera_flip_v) {
-            mEye->setFlip(mTrackingBuffer.data()->header.camera_flip_h = !!mTrackingBuffer.data()->header.camera_flip_h,
-                          mTrackingBuffer.data()->header.camera_flip_v = !!mTrackingBuffer.data()->header.camera_flip_v);
+            header.controls.values.set(command.param, command.value);
+            applyControls();
+            header.controls.changed();
+            return header.controls.values.get(command.param);
+
+        case TrackingBuffer::kCommandResetMotion:
+            header.status.total_motion_lock.beginWrite();
+            header.status.total_motionX = 0.f;
+            header.status.total_motionY = 0.f;
+            header.status.total_motion_lock.endWrite();
+            return 0;
+
+        case TrackingBuffer::kCommandResetPoints:
+            mResetPoints = true;
+            return 0;
+
+        case TrackingBuffer::kCommandSnapshot: {
+            // The next frame we capture; the GUI thread saves it once it's published
+            uint32_t frame_counter = header.status.frame_counter.load(memory_order_relaxed);
+            lock_guard<mutex> lock(mSnapshotMutex);
+            mSnapshotFrames.push_back(frame_counter);
+            return frame_counter;
         }
 
-        #undef CAMERA_PARAM
+        default:
+            return -1;
+    }
+}
 
-        if (mEye->isNewFrame()) {
-            captureFrame();
+void SpeedyEyeApp::updateClock()
+{
+    // Bracket our own clock with two monotonic readings, and assume it was read halfway
+    int64_t before = clock_monotonic_ns();
+    double seconds = getElapsedSeconds();
+    int64_t realtime = clock_realtime_ns();
+    int64_t after = clock_monotonic_ns();
+
+    mTrackingBuffer.publishClock(seconds, before + (after - before) / 2, realtime);
+    mLastClockUpdate = seconds;
+}
+
+void SpeedyEyeApp::updateClients()
+{
+    // Once a second is plenty to spot slow or dead clients
+    double now = getElapsedSeconds();
+    if (mLastClientUpdate >= 0 && now - mLastClientUpdate < 1.0) {
+        return;
+    }
+    mLastClientUpdate = now;
+
+    for (auto& client : mTrackingBuffer.reapClients()) {
+        console() << "Client " << client.name << " (" << client.owner << ") stopped responding after "
+                  << client.frames_consumed << " frames, freeing its slot" << endl;
+    }
+
+    vector<TrackingBuffer::ClientStats_t> clients;
+    mTrackingBuffer.readClients(clients);
+    mNumClients = 0;
+    mMaxClientLag = 0;
+    mClientLatency = 0;
+    for (auto& client : clients) {
+        if (!client.dead) {
+            mNumClients++;
+            mMaxClientLag = max<int>(mMaxClientLag, client.lag);
+            mClientLatency = max<int>(mClientLatency, client.latency_us);
         }
     }
+    mVideoViewers = mVideoServer.numClients();
+}
 
-    mEye->stop();
+void SpeedyEyeApp::updateGuiControls()
+{
+    // Load the generation first; if the producer changes anything while we copy, it
+    // changes the generation again afterwards and we copy again next time.
+    auto& controls = mTrackingBuffer.header().controls;
+    uint32_t generation = controls.generation.load(memory_order_acquire);
+    if (generation != mControlsGeneration) {
+        mControlsGeneration = generation;
+        mGuiControls = controls.values;
+    }
+}
+
+void SpeedyEyeApp::saveSnapshots()
+{
+    vector<uint32_t> frames;
+    {
+        lock_guard<mutex> lock(mSnapshotMutex);
+        frames.swap(mSnapshotFrames);
+    }
+
+    for (uint32_t index : frames) {
+        static uint32_t pixels[TrackingBuffer::kWidth * TrackingBuffer::kHeight];
+
+        auto result = mTrackingBuffer.readPixels(index, [] (const TrackingBuffer::Pixels_t &slot) {
+            memcpy(pixels, slot.pixels, sizeof pixels);
+        });
+
+        if (result == TrackingBuffer::kReadNotReady) {
+            // Not captured yet, try again next time
+            lock_guard<mutex> lock(mSnapshotMutex);
+            mSnapshotFrames.push_back(index);
+            continue;
+        }
+        if (result != TrackingBuffer::kReadOk) {
+            console() << "Missed snapshot of frame " << index << endl;
+            continue;
+        }
+
+        // The luminance channel is left out, so the image isn't see-through
+        fs::path path = getDocumentsDirectory() / ("speedyeye-" + toString(index) + ".png");
+        writeImage(path, Surface8u((uint8_t*) pixels, TrackingBuffer::kWidth, TrackingBuffer::kHeight,
+                                   TrackingBuffer::kWidth * 4, SurfaceChannelOrder::BGRX));
+        console() << "Saved " << path.string() << endl;
+    }
+}
+
+void SpeedyEyeApp::applyControls()
+{
+    auto& controls = mTrackingBuffer.header().controls.values;
+
+    #define CAMERA_PARAM(field, getter, setter) \
+        if (mEye->getter() != controls.field) { \
+            mEye->setter(controls.field); \
+            controls.field = mEye->getter(); \
+        }
+
+    CAMERA_PARAM(camera_autogain, getAutogain, setAutogain);
+    CAMERA_PARAM(camera_gain, getGain, setGain);
+    CAMERA_PARAM(camera_exposure, getExposure, setExposure);
+    CAMERA_PARAM(camera_sharpness, getSharpness, setSharpness);
+    CAMERA_PARAM(camera_hue, getHue, setHue);
+    CAMERA_PARAM(camera_awb, getAutoWhiteBalance, setAutoWhiteBalance);
+    CAMERA_PARAM(camera_brightness, getBrightness, setBrightness);
+    CAMERA_PARAM(camera_contrast, getContrast, setContrast);
+    CAMERA_PARAM(camera_blueblc, getBlueBalance, setBlueBalance);
+    CAMERA_PARAM(camera_redblc, getRedBalance, setRedBalance);
+
+    if (mEye->getFlipH() != controls.camera_flip_h ||
+        mEye->getFlipV() != controls.camera_flip_v) {
+        mEye->setFlip((controls.camera_flip_h = !!controls.camera_flip_h),
+                      (controls.camera_flip_v = !!controls.camera_flip_v));
+    }
+
+    #undef CAMERA_PARAM
 }
 
 void SpeedyEyeApp::shutdown()
@@ -168,6 +474,8 @@ void SpeedyEyeApp::shutdown()
     if (mThread.joinable()) {
         mThread.join();
     }
+    mUdpPublisher.stop();
+    mVideoServer.stop();
 }
 
 void SpeedyEyeApp::draw()
@@ -185,6 +493,10 @@ void SpeedyEyeApp::draw()
     gl::clear();
 
 	if (mInitialized) {
+        updateGuiControls();
+        updateClients();
+        saveSnapshots();
+
 		// Coordinate system to match the camera resolution
 		gl::setMatricesWindow(TrackingBuffer::kWidth, TrackingBuffer::kHeight);
 		mTrackingView.draw(mTrackingBuffer);
@@ -195,7 +507,7 @@ void SpeedyEyeApp::draw()
 		// Reminder of the buffer path we're using
 		gl::color(0.7f, 1.f, 0.8f);
 		gl::enableAlphaBlending();
-		gl::drawStringCentered(mTrackingBufferPath.string().c_str(), Vec2i(getWindowWidth() / 2, getWindowHeight() - 20));
+		gl::drawStringCentered(mTrackingBuffer.location(), Vec2i(getWindowWidth() / 2, getWindowHeight() - 20));
 
 		mParams->draw();
 	}
@@ -203,40 +515,74 @@ void SpeedyEyeApp::draw()
 
 void SpeedyEyeApp::captureFrame()
 {
-    auto shm = mTrackingBuffer.data();
-    uint32_t frame_counter = shm->header.frame_counter;
-    auto& newFrame = shm->frames[frame_counter & (TrackingBuffer::kNumFrames-1)];
+    auto& header = mTrackingBuffer.header();
+    uint32_t frame_counter = header.status.frame_counter.load(memory_order_relaxed);
+    auto& newFrame = mTrackingBuffer.frame(frame_counter);
+    auto& newPixels = mTrackingBuffer.pixels(frame_counter);
+
+    // Readers of these slots can detect that they're being overwritten
+    newFrame.lock.beginWrite();
+    newFrame.frame_index = frame_counter;
+    newPixels.lock.beginWrite();
+    newPixels.frame_index = frame_counter;
 
     double timeA = getElapsedSeconds();
-    newFrame.init(timeA);
+    newFrame.init(timeA, clock_monotonic_ns());
+
+    // Refresh the mapping from our timestamps to the system clocks about once a second
+    if (mLastClockUpdate < 0 || timeA - mLastClockUpdate >= 1.0) {
+        updateClock();
+    }
 
     yuv422_to_rgbl(mEye->getLastFramePointer(), mEye->getRowBytes(),
-                   (uint8_t*) newFrame.pixels,
-                   TrackingBuffer::kWidth, TrackingBuffer::kHeight);
+                   (uint8_t*) newPixels.pixels,
+                   TrackingBuffer::kWidth, TrackingBuffer::kHeight,
+                   newFrame.luma_histogram);
+    newFrame.updateLumaStats();
+    newPixels.updatePreviews();
+
+    if (mResetPoints) {
+        // This frame starts out empty; new points are found from the next one on
+        mResetPoints = false;
 
-    if (frame_counter > 0) {
+    } else if (frame_counter > 0) {
         // There exists a previous frame, we can do tracking
-        auto& prevFrame = shm->frames[(frame_counter - 1) & (TrackingBuffer::kNumFrames-1)];
+        auto& prevFrame = mTrackingBuffer.frame(frame_counter - 1);
+        auto& prevPixels = mTrackingBuffer.pixels(frame_counter - 1);
 
-        newFrame.trackPoints(prevFrame);
+        newFrame.trackPoints(prevFrame, prevPixels, newPixels);
         double timeB = getElapsedSeconds();
 
-        shm->header.total_motionX += newFrame.motionX;
-        shm->header.total_motionY += newFrame.motionY;
+        // After a restart, the previous frame is from before the gap. Points carry over,
+        // but whatever motion they show isn't something that happened in one frame.
+        bool integrate = frame_counter != mFirstFrame;
+        if (integrate) {
+            header.status.total_motion_lock.beginWrite();
+            header.status.total_motionX += newFrame.motionX;
+            header.status.total_motionY += newFrame.motionY;
+            header.status.total_motion_lock.endWrite();
+        }
+        mTrackingBuffer.updateRegions(newFrame, integrate);
+        mTrackingBuffer.updateTriggers(newFrame, integrate);
         
         double trackingTime = (timeB - timeA) * TrackingBuffer::kFPS;
         mTrackingTime = trackingTime;
         
         if (trackingTime < mMaxTrackingTime && newFrame.num_points < TrackingBuffer::kMaxTrackingPoints) {
-            newFrame.newPoint(prevFrame);
+            newFrame.newPoint(prevFrame, prevPixels, newPixels, header.status.next_track_id);
         }
 
         mCurrentNumPoints = newFrame.num_points;
     }
     
+    newFrame.updateTrackHash();
+
     // New frame is now fully written
-    shm->header.frame_counter = frame_counter + 1;
-    mAverageCameraFps = shm->header.frame_counter / getElapsedSeconds();
+    newPixels.lock.endWrite();
+    newFrame.lock.endWrite();
+    mTrackingBuffer.appendHistory(newFrame);
+    mTrackingBuffer.publishFrame(frame_counter + 1);
+    mAverageCameraFps = (header.status.frame_counter - mFirstFrame) / getElapsedSeconds();
 }
 
 
@@ -2,69 +2,1049 @@
 // MIT license
 
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
 #include "cinder/Rand.h"
+#include "cinder/Color.h"
 #include "CinderOpenCV.h"
 #include "TrackingBuffer.h"
+#include "downsample.h"
+#include "futex.h"
+#include "clock.h"
 
 using namespace std;
 using namespace boost::interprocess;
 using namespace cv;
 
 
-bool TrackingBuffer::open(const char *filename)
+const char *TrackingBuffer::kDefaultSharedMemoryName = "speedyeye-tracking-buffer";
+
+// Transparent huge pages are 2 MB on the platforms that have them
+static const uint64_t kHugePageSize = 2 << 20;
+
+TrackingBuffer::Options::Options()
+    : backing(kSharedMemory),
+      name(kDefaultSharedMemoryName),
+      huge_pages(false),
+      prefault(true),
+      lock_memory(false),
+      attach(true),
+      num_frames(kDefaultFrames),
+      history_frames(kDefaultHistoryFrames)
+{}
+
+TrackingBuffer::TrackingBuffer()
+    : mNumFrames(0),
+      mHistoryFrames(0),
+      mAttached(false)
+{
+    // At most one start or stop and one direction change per rule per frame
+    mPendingEvents.reserve(kMaxRules * 2);
+}
+
+// Ring depths must be powers of two, so frame_counter can be masked into a slot index
+static unsigned roundRingDepth(unsigned requested, unsigned minimum, unsigned maximum)
 {
-    // Make an empty file of the right size
-    FILE *f = fopen(filename, "wb");
-    if (!f) {
+    unsigned depth = minimum;
+    while (depth < requested && depth < maximum) {
+        depth <<= 1;
+    }
+    return depth;
+}
+
+bool TrackingBuffer::open(const Options &options)
+{
+    mOptions = options;
+    mWarnings.clear();
+
+    // An odd sequence never matches a region's config lock, so every region of a new buffer
+    // is read fresh. Continuing a buffer picks up the regions as they are; see below.
+    for (unsigned i = 0; i < kMaxRegions; i++) {
+        mRegionSequences[i] = 1;
+    }
+
+    // Likewise for rules, which also start over in the stopped state
+    for (unsigned i = 0; i < kMaxRules; i++) {
+        mRules[i].sequence = 1;
+        mRules[i].config.events = 0;
+        mRules[i].started = false;
+    }
+    mPendingEvents.clear();
+
+    mNumFrames = roundRingDepth(options.num_frames, kMinFrames, kMaxFrames);
+    if (mNumFrames != options.num_frames) {
+        mWarnings.push_back("Ring depth adjusted to " + to_string(mNumFrames) + " frames");
+    }
+
+    mHistoryFrames = roundRingDepth(options.history_frames, kMinHistoryFrames, kMaxHistoryFrames);
+    if (mHistoryFrames != options.history_frames) {
+        mWarnings.push_back("History depth adjusted to " + to_string(mHistoryFrames) + " frames");
+    }
+
+    // Round up so the tail of the buffer can also live in a huge page
+    uint64_t size = totalSize(mNumFrames, mHistoryFrames);
+    if (options.huge_pages) {
+        size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    }
+
+    mAttached = options.attach && attachExisting();
+    if (mAttached) {
+        checkAvailableMemory(mMappedRegion.get_size());
+        adviseMemory();
+
+        // Pick up where the last producer left off. Its settings, counters, totals, and
+        // tracking points are all still here; only a write it was in the middle of is suspect.
+        Header_t& header = this->header();
+        uint32_t frame_counter = header.status.frame_counter.load(memory_order_relaxed);
+        frame(frame_counter).lock.recover();
+        pixels(frame_counter).lock.recover();
+        historyFrame(frame_counter).lock.recover();
+        uint32_t event_counter = header.events.event_counter.load(memory_order_relaxed);
+        header.events.ring[event_counter & (kEventRingSize - 1)].lock.recover();
+        header.status.total_motion_lock.recover();
+
+        // Regions keep their configuration and integrated totals, like total_motion. Taking
+        // the current sequence means updateRegions() won't see a reconfiguration and zero them.
+        for (unsigned r = 0; r < kMaxRegions; r++) {
+            Region_t& region = header.regions[r];
+            region.motion_lock.recover();
+            uint32_t seq = region.config_lock.readBegin();
+            RegionConfig_t copy = region.config;
+            if (!region.config_lock.readRetry(seq)) {
+                mRegionConfigs[r] = copy;
+                mRegionSequences[r] = seq;
+            }
+        }
+
+        header.status.epoch.fetch_add(1, memory_order_release);
+        return true;
+    }
+
+    // Replace any buffer that's already here instead of rewriting it in place, so clients
+    // still mapping it never fault when it's truncated or shrinks. Theirs becomes an orphan,
+    // marked as such so they know to reopen.
+    uint32_t epoch = retireExisting();
+    try {
+        if (options.backing == Options::kFile) {
+            // Make an empty file of the right size, which can be well over 2 GB
+            remove(options.name.c_str());
+            FILE *f = fopen(options.name.c_str(), "wb");
+            if (!f) {
+                return false;
+            }
+#ifdef _WIN32
+            _fseeki64(f, int64_t(size - 1), SEEK_SET);
+#else
+            fseeko(f, off_t(size - 1), SEEK_SET);
+#endif
+            fputc(0, f);
+            fclose(f);
+
+            mFileMapping = file_mapping(options.name.c_str(), read_write);
+            mMappedRegion = mapped_region(mFileMapping, read_write, 0, size_t(size));
+
+        } else {
+#ifdef _WIN32
+            // Named objects can't be removed while they're open, but they never change size
+            // either, so rewriting one that clients are holding open is safe
+            mSharedMemory = windows_shared_memory(open_or_create, options.name.c_str(), read_write, size_t(size));
+#else
+            shared_memory_object::remove(options.name.c_str());
+            mSharedMemory = shared_memory_object(create_only, options.name.c_str(), read_write);
+            mSharedMemory.truncate(offset_t(size));
+#endif
+            mMappedRegion = mapped_region(mSharedMemory, read_write, 0, size_t(size));
+        }
+    } catch (interprocess_exception &e) {
+        mWarnings.push_back(e.what());
         return false;
     }
-    fseek(f, sizeof(SharedMemory_t)-1, SEEK_SET);
-    fputc(0, f);
-    fclose(f);
 
-    mFileMapping = file_mapping(filename, read_write);
-    mMappedRegion = mapped_region(mFileMapping, read_write);
+    checkAvailableMemory(size);
+    adviseMemory();
+
+    // Stale frames are never read once the frame counter is reset. Clearing them
+    // anyway is how we prefault: every page gets allocated now, not during capture.
+    Header_t& header = this->header();
+    memset((void*) &header, 0, sizeof header);
+    if (options.prefault) {
+        memset((void*) &frame(0), 0, mMappedRegion.get_size() - pointsSegmentOffset());
+    }
 
     // Set up default camera settings
-    Header_t& header = data()->header;
-
-    header.min_point_quality = 0.1f;
-    header.camera_autogain = true;
-    header.camera_gain = 20;
-    header.camera_exposure = 120;
-    header.camera_sharpness = 0;
-    header.camera_hue = 143;
-    header.camera_awb = true;
-    header.camera_brightness = 11;
-    header.camera_contrast = 37;
-    header.camera_blueblc = 128;
-    header.camera_redblc = 128;
-    header.camera_flip_h = false;
-    header.camera_flip_v = false;
-    header.total_motionX = 0.f;
-    header.total_motionY = 0.f;
+
+    header.controls.values.min_point_quality = 0.1f;
+    header.controls.values.camera_autogain = true;
+    header.controls.values.camera_gain = 20;
+    header.controls.values.camera_exposure = 120;
+    header.controls.values.camera_sharpness = 0;
+    header.controls.values.camera_hue = 143;
+    header.controls.values.camera_awb = true;
+    header.controls.values.camera_brightness = 11;
+    header.controls.values.camera_contrast = 37;
+    header.controls.values.camera_blueblc = 128;
+    header.controls.values.camera_redblc = 128;
+    header.controls.values.camera_flip_h = false;
+    header.controls.values.camera_flip_v = false;
+    header.controls.generation = 1;
+    for (unsigned i = 0; i < kCommandQueueSize; i++) {
+        header.commands.queue[i].sequence = i;
+    }
+    header.status.total_motionX = 0.f;
+    header.status.total_motionY = 0.f;
+    header.status.next_track_id = 1;
+    header.status.epoch = max(epoch + 1, 1u);
+
+    // Unlike the epoch, this changes only when a buffer is created
+    random_device entropy;
+    uint64_t nonce = (uint64_t(entropy()) << 32 | entropy()) ^ uint64_t(clock_realtime_ns());
+    header.status.creation_nonce = nonce ? nonce : 1;
+
+    // Describe ourselves, and only then mark the header as valid
+    initLayout(header.layout, mNumFrames, mHistoryFrames);
+    header.version = kVersion;
+    atomic_thread_fence(memory_order_release);
+    header.magic = kMagic;
 
     return true;
 }
 
-void TrackingBuffer::Frame_t::init(double timestamp)
+bool TrackingBuffer::attachExisting()
+{
+    // Map whatever is already there, without creating or resizing anything. Any failure
+    // just means there's no buffer to continue, and we start a new one.
+    try {
+        if (mOptions.backing == Options::kFile) {
+            FILE *f = fopen(mOptions.name.c_str(), "rb");
+            if (!f) {
+                return false;
+            }
+            fclose(f);
+            mFileMapping = file_mapping(mOptions.name.c_str(), read_write);
+            mMappedRegion = mapped_region(mFileMapping, read_write);
+        } else {
+#ifdef _WIN32
+            mSharedMemory = windows_shared_memory(open_only, mOptions.name.c_str(), read_write);
+#else
+            mSharedMemory = shared_memory_object(open_only, mOptions.name.c_str(), read_write);
+#endif
+            mMappedRegion = mapped_region(mSharedMemory, read_write);
+        }
+    } catch (interprocess_exception &) {
+        return false;
+    }
+
+    // Only continue a buffer that clients would map exactly the same way we're about to
+    if (mMappedRegion.get_size() < sizeof(Header_t)
+        || !isCompatible(header(), mMappedRegion.get_size())
+        || header().layout.num_frames != mNumFrames
+        || header().layout.history_frames != mHistoryFrames) {
+        mWarnings.push_back("Existing buffer has a different layout, starting a new one");
+        mMappedRegion = mapped_region();
+        return false;
+    }
+
+    return true;
+}
+
+// Mark whatever buffer is already under our name as replaced, waking any clients sleeping
+// on it, and return its epoch so ours can follow on from it. Zero if there wasn't one.
+uint32_t TrackingBuffer::retireExisting()
+{
+    uint32_t epoch = 0;
+    try {
+        mapped_region region;
+        if (mOptions.backing == Options::kFile) {
+            FILE *f = fopen(mOptions.name.c_str(), "rb");
+            if (!f) {
+                return 0;
+            }
+            fclose(f);
+            file_mapping file(mOptions.name.c_str(), read_write);
+            region = mapped_region(file, read_write);
+        } else {
+#ifdef _WIN32
+            windows_shared_memory shm(open_only, mOptions.name.c_str(), read_write);
+#else
+            shared_memory_object shm(open_only, mOptions.name.c_str(), read_write);
+#endif
+            region = mapped_region(shm, read_write);
+        }
+        if (region.get_size() < sizeof(Header_t)) {
+            return 0;
+        }
+
+        Header_t& header = *static_cast<Header_t*>(region.get_address());
+        if (header.magic != kMagic) {
+            return 0;
+        }
+        bool current = header.version == kVersion;
+        if (current) {
+            epoch = header.status.epoch.load(memory_order_relaxed);
+        }
+        header.magic = 0;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (current) {
+            futex_wake_all(&header.status.frame_counter);
+            futex_wake_all(&header.events.event_counter);
+        }
+    } catch (interprocess_exception &) {
+        // Nothing there, or nothing we can map
+    }
+    return epoch;
+}
+
+void TrackingBuffer::adviseMemory()
+{
+    void *addr = mMappedRegion.get_address();
+    size_t size = mMappedRegion.get_size();
+
+    if (mOptions.huge_pages) {
+#ifdef MADV_HUGEPAGE
+        // Must happen before the first touch. Shared memory also needs
+        // /sys/kernel/mm/transparent_hugepage/shmem_enabled set to "advise" or better.
+        if (madvise(addr, size, MADV_HUGEPAGE)) {
+            mWarnings.push_back("Transparent huge pages are not available for the tracking buffer");
+        }
+#else
+        mWarnings.push_back("Huge pages are not supported on this platform");
+#endif
+    }
+
+    if (mOptions.lock_memory) {
+#ifdef _WIN32
+        bool locked = VirtualLock(addr, size) != 0;
+#else
+        bool locked = mlock(addr, size) == 0;
+#endif
+        if (!locked) {
+            mWarnings.push_back("Couldn't lock the tracking buffer into memory. Check the memory lock limit.");
+        }
+    }
+}
+
+// Physical memory we could still claim, in bytes, or zero if unknown
+static uint64_t availableMemory()
+{
+#if defined(_WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof status;
+    if (GlobalMemoryStatusEx(&status)) {
+        return status.ullAvailPhys;
+    }
+#elif defined(__linux__)
+    // MemAvailable includes reclaimable page cache, which is what we'd really get
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long long kb;
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                fclose(f);
+                return uint64_t(kb) << 10;
+            }
+        }
+        fclose(f);
+    }
+#elif defined(__APPLE__)
+    // No cheap "available" figure here; total RAM still catches the worst mistakes
+    uint64_t total = 0;
+    size_t len = sizeof total;
+    if (!sysctlbyname("hw.memsize", &total, &len, NULL, 0)) {
+        return total;
+    }
+#endif
+    return 0;
+}
+
+void TrackingBuffer::checkAvailableMemory(uint64_t size)
+{
+    uint64_t available = availableMemory();
+    if (available && size > available) {
+        mWarnings.push_back("Tracking buffer needs " + to_string(size >> 20) + " MB, but only " +
+                            to_string(available >> 20) + " MB of RAM is available. Try a shallower ring.");
+    }
+
+#ifdef __linux__
+    // Shared memory only gets transparent huge pages if the kernel allows it
+    if (mOptions.huge_pages && mOptions.backing == Options::kSharedMemory) {
+        FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+        if (f) {
+            char line[128] = "";
+            if (fgets(line, sizeof line, f) && (strstr(line, "[never]") || strstr(line, "[deny]"))) {
+                mWarnings.push_back("Huge pages are disabled for shared memory, see "
+                                    "/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+            }
+            fclose(f);
+        }
+    }
+#endif
+}
+
+std::string TrackingBuffer::location() const
+{
+    if (mOptions.backing == Options::kFile) {
+        return mOptions.name;
+    }
+#ifdef __linux__
+    return "/dev/shm/" + mOptions.name;
+#else
+    return "Shared memory \"" + mOptions.name + "\"";
+#endif
+}
+
+void TrackingBuffer::initLayout(Layout_t &layout, unsigned numFrames, unsigned historyFrames)
+{
+    memset(&layout, 0, sizeof layout);
+
+    layout.layout_size = sizeof(Layout_t);
+    layout.header_size = sizeof(Header_t);
+    layout.total_size = totalSize(numFrames, historyFrames);
+
+    layout.width = kWidth;
+    layout.height = kHeight;
+    layout.fps = kFPS;
+    layout.num_frames = numFrames;
+    layout.max_points = kMaxTrackingPoints;
+
+    layout.total_motion_offset = offsetof(Header_t, status.total_motionX);
+    layout.total_motion_lock_offset = offsetof(Header_t, status.total_motion_lock);
+    layout.frame_counter_offset = offsetof(Header_t, status.frame_counter);
+    layout.min_point_quality_offset = offsetof(Header_t, controls.values.min_point_quality);
+    layout.camera_controls_offset = offsetof(Header_t, controls.values.camera_autogain);
+    layout.status_offset = offsetof(Header_t, status);
+    layout.controls_offset = offsetof(Header_t, controls);
+    layout.controls_generation_offset = offsetof(Header_t, controls.generation);
+    layout.clients_offset = offsetof(Header_t, clients);
+    layout.client_stride = sizeof(ClientSlot_t);
+    layout.max_clients = kMaxClients;
+    layout.frame_waiters_offset = offsetof(Header_t, frame_waiters);
+    layout.next_track_id_offset = offsetof(Header_t, status.next_track_id);
+
+    layout.header_segment_size = pointsSegmentOffset();
+    layout.points_segment_offset = pointsSegmentOffset();
+    layout.points_segment_size = pixelsSegmentOffset(numFrames) - pointsSegmentOffset();
+    layout.pixels_segment_offset = pixelsSegmentOffset(numFrames);
+    layout.pixels_segment_size = historySegmentOffset(numFrames) - pixelsSegmentOffset(numFrames);
+    layout.history_segment_offset = historySegmentOffset(numFrames);
+    layout.history_segment_size = totalSize(numFrames, historyFrames) - historySegmentOffset(numFrames);
+
+    layout.frame_stride = sizeof(Frame_t);
+    layout.frame_lock_offset = offsetof(Frame_t, lock);
+    layout.frame_index_offset = offsetof(Frame_t, frame_index);
+    layout.frame_timestamp_offset = offsetof(Frame_t, timestamp);
+    layout.frame_num_points_offset = offsetof(Frame_t, num_points);
+    layout.frame_motion_offset = offsetof(Frame_t, motionX);
+    layout.frame_luma_stats_offset = offsetof(Frame_t, luma_mean);
+    layout.frame_luma_histogram_offset = offsetof(Frame_t, luma_histogram);
+
+    layout.pixels_stride = sizeof(Pixels_t);
+    layout.pixels_lock_offset = offsetof(Pixels_t, lock);
+    layout.pixels_frame_index_offset = offsetof(Pixels_t, frame_index);
+    layout.pixels_full_offset = offsetof(Pixels_t, pixels);
+    layout.pixel_row_stride = kWidth * sizeof(uint32_t);
+    layout.pixels_half_offset = offsetof(Pixels_t, pixels_half);
+    layout.pixels_quarter_offset = offsetof(Pixels_t, pixels_quarter);
+
+    layout.frame_points_x_offset = offsetof(Frame_t, points.x);
+    layout.frame_points_y_offset = offsetof(Frame_t, points.y);
+    layout.frame_points_dx_offset = offsetof(Frame_t, points.dx);
+    layout.frame_points_dy_offset = offsetof(Frame_t, points.dy);
+    layout.frame_points_age_offset = offsetof(Frame_t, points.age);
+    layout.frame_points_link_offset = offsetof(Frame_t, points.link);
+    layout.frame_points_id_offset = offsetof(Frame_t, points.id);
+    layout.frame_points_weight_offset = offsetof(Frame_t, points.weight);
+
+    layout.regions_offset = offsetof(Header_t, regions);
+    layout.max_regions = kMaxRegions;
+    layout.region_stride = sizeof(Region_t);
+    layout.region_owner_offset = offsetof(Region_t, owner);
+    layout.region_config_lock_offset = offsetof(Region_t, config_lock);
+    layout.region_type_offset = offsetof(Region_t, config.type);
+    layout.region_rect_offset = offsetof(Region_t, config.x0);
+    layout.region_mask_offset = offsetof(Region_t, config.mask);
+    layout.region_motion_lock_offset = offsetof(Region_t, motion_lock);
+    layout.region_frame_index_offset = offsetof(Region_t, motion.frame_index);
+    layout.region_num_points_offset = offsetof(Region_t, motion.num_points);
+    layout.region_motion_offset = offsetof(Region_t, motion.motionX);
+    layout.region_total_offset = offsetof(Region_t, motion.totalX);
+
+    layout.rules_offset = offsetof(Header_t, rules);
+    layout.max_rules = kMaxRules;
+    layout.rule_stride = sizeof(Rule_t);
+    layout.rule_owner_offset = offsetof(Rule_t, owner);
+    layout.rule_config_lock_offset = offsetof(Rule_t, config_lock);
+    layout.rule_events_offset = offsetof(Rule_t, config.events);
+    layout.rule_region_offset = offsetof(Rule_t, config.region);
+    layout.rule_threshold_offset = offsetof(Rule_t, config.threshold);
+    layout.rule_debounce_offset = offsetof(Rule_t, config.debounce);
+    layout.events_offset = offsetof(Header_t, events);
+    layout.event_counter_offset = offsetof(Header_t, events.event_counter);
+    layout.event_waiters_offset = offsetof(Header_t, events.event_waiters);
+    layout.event_ring_offset = offsetof(Events_t, ring);
+    layout.event_ring_size = kEventRingSize;
+    layout.event_stride = sizeof(Event_t);
+    layout.event_lock_offset = offsetof(Event_t, lock);
+    layout.event_index_offset = offsetof(Event_t, event_index);
+    layout.event_rule_offset = offsetof(Event_t, rule);
+    layout.event_type_offset = offsetof(Event_t, type);
+    layout.event_frame_index_offset = offsetof(Event_t, frame_index);
+    layout.event_timestamp_offset = offsetof(Event_t, timestamp);
+    layout.event_timestamp_ns_offset = offsetof(Event_t, timestamp_ns);
+    layout.event_motion_offset = offsetof(Event_t, motionX);
+
+    layout.client_owner_offset = offsetof(ClientSlot_t, owner);
+    layout.client_next_frame_offset = offsetof(ClientSlot_t, next_frame);
+    layout.client_heartbeat_offset = offsetof(ClientSlot_t, heartbeat_ns);
+    layout.client_consumed_offset = offsetof(ClientSlot_t, frames_consumed);
+    layout.client_dropped_offset = offsetof(ClientSlot_t, frames_dropped);
+    layout.client_latency_offset = offsetof(ClientSlot_t, latency_us);
+    layout.client_name_offset = offsetof(ClientSlot_t, name);
+    layout.client_name_size = kClientNameSize;
+    layout.creation_nonce_offset = offsetof(Header_t, status.creation_nonce);
+    layout.frame_track_hash_offset = offsetof(Frame_t, track_hash);
+    layout.track_hash_size = kTrackHashSize;
+
+    layout.history_frames = historyFrames;
+    layout.history_frame_stride = sizeof(HistoryFrame_t);
+    layout.history_lock_offset = offsetof(HistoryFrame_t, lock);
+    layout.history_frame_index_offset = offsetof(HistoryFrame_t, frame_index);
+    layout.history_timestamp_offset = offsetof(HistoryFrame_t, timestamp);
+    layout.history_motion_offset = offsetof(HistoryFrame_t, motionX);
+    layout.history_num_points_offset = offsetof(HistoryFrame_t, num_points);
+    layout.history_first_point_offset = offsetof(HistoryFrame_t, first_point);
+    layout.history_points_offset = uint32_t(historyPointsOffset(historyFrames));
+    layout.history_points_size = historyFrames * kHistoryPointsPerFrame;
+    layout.history_point_stride = sizeof(HistoryPoint_t);
+    layout.history_point_counter_offset = offsetof(Header_t, status.history_point_counter);
+    layout.epoch_offset = offsetof(Header_t, status.epoch);
+
+    layout.commands_offset = offsetof(Header_t, commands);
+    layout.command_queue_size = kCommandQueueSize;
+    layout.command_enqueue_pos_offset = offsetof(Header_t, commands.enqueue_pos);
+    layout.command_completed_offset = offsetof(Header_t, commands.completed);
+    layout.command_queue_offset = offsetof(Commands_t, queue);
+    layout.command_stride = sizeof(Command_t);
+    layout.command_sequence_offset = offsetof(Command_t, sequence);
+    layout.command_type_offset = offsetof(Command_t, type);
+    layout.command_param_offset = offsetof(Command_t, param);
+    layout.command_value_offset = offsetof(Command_t, value);
+    layout.command_acks_offset = offsetof(Commands_t, acks);
+    layout.command_ack_stride = sizeof(CommandAck_t);
+    layout.command_ack_ticket_offset = offsetof(CommandAck_t, ticket);
+    layout.command_ack_result_offset = offsetof(CommandAck_t, result);
+
+    layout.frame_timestamp_ns_offset = offsetof(Frame_t, timestamp_ns);
+    layout.history_timestamp_ns_offset = offsetof(HistoryFrame_t, timestamp_ns);
+    layout.clock_lock_offset = offsetof(Header_t, status.clock.lock);
+    layout.clock_seconds_offset = offsetof(Header_t, status.clock.seconds);
+    layout.clock_monotonic_offset = offsetof(Header_t, status.clock.monotonic_ns);
+    layout.clock_realtime_offset = offsetof(Header_t, status.clock.realtime_ns);
+
+    layout.frame_cell_start_offset = offsetof(Frame_t, cell_start);
+    layout.frame_cell_points_offset = offsetof(Frame_t, cell_points);
+    layout.index_cell_size = kPointIndexCellSize;
+    layout.index_width = kPointIndexWidth;
+    layout.index_height = kPointIndexHeight;
+
+    layout.frame_motion_field_offset = offsetof(Frame_t, motion_field);
+    layout.motion_field_width = kMotionFieldWidth;
+    layout.motion_field_height = kMotionFieldHeight;
+    layout.motion_cell_stride = sizeof(MotionCell_t);
+}
+
+bool TrackingBuffer::isCompatible(const Header_t &header, uint64_t mappedSize)
+{
+    if (header.magic != kMagic || header.version != kVersion) {
+        return false;
+    }
+
+    unsigned numFrames = header.layout.num_frames;
+    if (numFrames < kMinFrames || numFrames > kMaxFrames || (numFrames & (numFrames - 1))) {
+        return false;
+    }
+
+    unsigned historyFrames = header.layout.history_frames;
+    if (historyFrames < kMinHistoryFrames || historyFrames > kMaxHistoryFrames || (historyFrames & (historyFrames - 1))) {
+        return false;
+    }
+
+    Layout_t expected;
+    initLayout(expected, numFrames, historyFrames);
+    return !memcmp(&header.layout, &expected, sizeof expected)
+        && mappedSize >= expected.total_size;
+}
+
+void TrackingBuffer::appendHistory(const Frame_t &frame)
+{
+    Header_t& header = this->header();
+    HistoryFrame_t& slot = historyFrame(frame.frame_index);
+    unsigned n = min<unsigned>(frame.num_points, 0+kMaxTrackingPoints);
+
+    // Claim pool space before overwriting it. Readers check the counter after copying
+    // points, so anything they copied from a claimed region is known to be suspect.
+    uint64_t first = header.status.history_point_counter.load(memory_order_relaxed);
+    header.status.history_point_counter.store(first + n, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (unsigned i = 0; i < n; i++) {
+        HistoryPoint_t& point = historyPoint(first + i);
+        point.id = frame.points.id[i];
+        point.x = frame.points.x[i];
+        point.y = frame.points.y[i];
+    }
+
+    slot.lock.beginWrite();
+    slot.frame_index = frame.frame_index;
+    slot.timestamp = frame.timestamp;
+    slot.timestamp_ns = frame.timestamp_ns;
+    slot.motionX = frame.motionX;
+    slot.motionY = frame.motionY;
+    slot.num_points = n;
+    slot.first_point = first;
+    slot.lock.endWrite();
+}
+
+TrackingBuffer::ReadResult TrackingBuffer::readHistory(uint32_t index, HistoryFrame_t &frame,
+                                                       vector<HistoryPoint_t> &points) const
+{
+    ReadResult result = readSlot(historyFrame(index), index, [&](const HistoryFrame_t &slot) {
+        frame.frame_index = slot.frame_index;
+        frame.timestamp = slot.timestamp;
+        frame.timestamp_ns = slot.timestamp_ns;
+        frame.motionX = slot.motionX;
+        frame.motionY = slot.motionY;
+        frame.num_points = slot.num_points;
+        frame.first_point = slot.first_point;
+    }, 8);
+
+    if (result != kReadOk) {
+        return result;
+    }
+
+    uint64_t capacity = numHistoryPoints();
+    points.resize(min<uint64_t>(frame.num_points, capacity));
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i] = historyPoint(frame.first_point + i);
+    }
+
+    // Pairs with the fence in appendHistory(): if the producer claimed any of these
+    // pool entries for a newer frame, we see the counter that says so.
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t claimed = header().status.history_point_counter.load(memory_order_relaxed);
+    if (claimed - frame.first_point > capacity) {
+        points.clear();
+        return kReadOverrun;
+    }
+
+    return kReadOk;
+}
+
+double TrackingBuffer::ControlValues_t::get(uint32_t id) const
+{
+    switch (id) {
+        case kControlMinPointQuality:   return min_point_quality;
+        case kControlAutogain:          return camera_autogain;
+        case kControlGain:              return camera_gain;
+        case kControlExposure:          return camera_exposure;
+        case kControlSharpness:         return camera_sharpness;
+        case kControlHue:               return camera_hue;
+        case kControlAutoWhiteBalance:  return camera_awb;
+        case kControlBrightness:        return camera_brightness;
+        case kControlContrast:          return camera_contrast;
+        case kControlBlueBalance:       return camera_blueblc;
+        case kControlRedBalance:        return camera_redblc;
+        case kControlFlipH:             return camera_flip_h;
+        case kControlFlipV:             return camera_flip_v;
+        default:                        return -1;
+    }
+}
+
+void TrackingBuffer::ControlValues_t::set(uint32_t id, double value)
+{
+    uint8_t byte = uint8_t(max(0.0, min(255.0, value + 0.5)));
+    uint8_t flag = value != 0;
+
+    switch (id) {
+        case kControlMinPointQuality:   min_point_quality = float(max(0.001, min(1.0, value))); break;
+        case kControlAutogain:          camera_autogain = flag; break;
+        case kControlGain:              camera_gain = byte; break;
+        case kControlExposure:          camera_exposure = byte; break;
+        case kControlSharpness:         camera_sharpness = byte; break;
+        case kControlHue:               camera_hue = byte; break;
+        case kControlAutoWhiteBalance:  camera_awb = flag; break;
+        case kControlBrightness:        camera_brightness = byte; break;
+        case kControlContrast:          camera_contrast = byte; break;
+        case kControlBlueBalance:       camera_blueblc = byte; break;
+        case kControlRedBalance:        camera_redblc = byte; break;
+        case kControlFlipH:             camera_flip_h = flag; break;
+        case kControlFlipV:             camera_flip_v = flag; break;
+    }
+}
+
+void TrackingBuffer::publishClock(double seconds, int64_t monotonic_ns, int64_t realtime_ns)
+{
+    ClockMapping_t& clock = header().status.clock;
+    clock.lock.beginWrite();
+    clock.seconds = seconds;
+    clock.monotonic_ns = monotonic_ns;
+    clock.realtime_ns = realtime_ns;
+    clock.lock.endWrite();
+}
+
+void TrackingBuffer::readClock(double &seconds, int64_t &monotonic_ns, int64_t &realtime_ns) const
+{
+    const ClockMapping_t& clock = header().status.clock;
+    uint32_t seq;
+    do {
+        seq = clock.lock.readBegin();
+        seconds = clock.seconds;
+        monotonic_ns = clock.monotonic_ns;
+        realtime_ns = clock.realtime_ns;
+    } while (clock.lock.readRetry(seq));
+}
+
+int64_t TrackingBuffer::timestampToMonotonic(double timestamp) const
+{
+    double seconds;
+    int64_t monotonic_ns, realtime_ns;
+    readClock(seconds, monotonic_ns, realtime_ns);
+    return monotonic_ns + int64_t((timestamp - seconds) * 1e9);
+}
+
+int64_t TrackingBuffer::timestampToRealtime(double timestamp) const
+{
+    double seconds;
+    int64_t monotonic_ns, realtime_ns;
+    readClock(seconds, monotonic_ns, realtime_ns);
+    return realtime_ns + int64_t((timestamp - seconds) * 1e9);
+}
+
+bool TrackingBuffer::RegionConfig_t::contains(float x, float y) const
+{
+    switch (type) {
+        case kRegionRect: 
+            return x >= x0 && x < x1 && y >= y0 && y < y1;
+        case kRegionMask: {
+            unsigned cell = Frame_t::pointCell(x, y);
+            return (mask[cell / 32] >> (cell % 32)) & 1;
+        }
+        default:
+            return false;
+    }
+}
+
+void TrackingBuffer::updateRegions(const Frame_t &frame, bool integrate)
+{
+    Header_t& header = this->header();
+
+    for (unsigned r = 0; r < kMaxRegions; r++) {
+        Region_t& region = header.regions[r];
+        RegionConfig_t& config = mRegionConfigs[r];
+
+        // Pick up new configurations. If the owner is in the middle of writing one, keep
+        // using the old one for this frame.
+        uint32_t seq = region.config_lock.readBegin();
+        bool reconfigured = false;
+        if (seq != mRegionSequences[r]) {
+            RegionConfig_t copy = region.config;
+            if (!region.config_lock.readRetry(seq)) {
+                config = copy;
+                mRegionSequences[r] = seq;
+                reconfigured = true;
+            }
+        }
+        if (config.type == kRegionOff && !reconfigured) {
+            continue;
+        }
+
+        RegionMotion_t motion;
+        motion.frame_index = frame.frame_index;
+        motion.num_points = 0;
+        motion.totalX = reconfigured ? 0.f : region.motion.totalX;
+        motion.totalY = reconfigured ? 0.f : region.motion.totalY;
+
+        float sumX = 0.f, sumY = 0.f, sumW = 0.f;
+        unsigned n = min<unsigned>(frame.num_points, 0+kMaxTrackingPoints);
+        for (unsigned i = 0; i < n; i++) {
+            if (frame.points.age[i] && config.contains(frame.points.x[i], frame.points.y[i])) {
+                motion.num_points++;
+                float w = frame.points.weight[i];
+                if (w > 0.f) {
+                    sumX += frame.points.dx[i] * w;
+                    sumY += frame.points.dy[i] * w;
+                    sumW += w;
+                }
+            }
+        }
+
+        motion.motionX = sumW > 0.f ? sumX / sumW : 0.f;
+        motion.motionY = sumW > 0.f ? sumY / sumW : 0.f;
+        if (integrate) {
+            motion.totalX += motion.motionX;
+            motion.totalY += motion.motionY;
+        }
+
+        region.motion_lock.beginWrite();
+        region.motion = motion;
+        region.motion_lock.endWrite();
+    }
+}
+
+void TrackingBuffer::updateTriggers(const Frame_t &frame, bool integrate)
+{
+    Header_t& header = this->header();
+
+    for (unsigned r = 0; r < kMaxRules; r++) {
+        Rule_t& rule = header.rules[r];
+        RuleState_t& state = mRules[r];
+
+        // Pick up new configurations the same way as updateRegions()
+        uint32_t seq = rule.config_lock.readBegin();
+        if (seq != state.sequence) {
+            RuleConfig_t copy = rule.config;
+            if (!rule.config_lock.readRetry(seq)) {
+                state.config = copy;
+                state.sequence = seq;
+                state.started = false;
+                state.pending = 0;
+            }
+        }
+
+        const RuleConfig_t& config = state.config;
+        if (!config.events || !integrate) {
+            continue;
+        }
+
+        float motionX = frame.motionX;
+        float motionY = frame.motionY;
+        if (config.region >= 0) {
+            if (config.region >= int(kMaxRegions)) {
+                continue;
+            }
+            // Only we write region motion, so it needs no lock here. Regions that are off
+            // weren't updated on this frame, and count as no motion.
+            const RegionMotion_t& motion = header.regions[config.region].motion;
+            bool current = motion.frame_index == frame.frame_index;
+            motionX = current ? motion.motionX : 0.f;
+            motionY = current ? motion.motionY : 0.f;
+        }
+
+        float speed = sqrtf(motionX * motionX + motionY * motionY);
+        int sector = int(floorf(atan2f(motionY, motionX) * (4.f / 3.14159265f) + 0.5f)) & 7;
+        uint32_t debounce = max<uint32_t>(config.debounce, 1);
+
+        // Start at the threshold, and stop only once below it by the hysteresis
+        bool change = state.started ? speed < config.threshold - config.hysteresis : speed >= config.threshold;
+        state.pending = change ? state.pending + 1 : 0;
+        if (state.pending >= debounce) {
+            state.started = !state.started;
+            state.pending = 0;
+            state.sector = state.pendingSector = sector;
+            state.pendingTurn = 0;
+
+            uint32_t type = state.started ? kEventStart : kEventStop;
+            if (config.events & type) {
+                fireEvent(frame, r, type, motionX, motionY);
+            }
+            continue;
+        }
+
+        // Direction only means something while the motion is above threshold
+        if (!state.started || speed < config.threshold) {
+            continue;
+        }
+        if (sector == state.sector) {
+            state.pendingTurn = 0;
+        } else if (sector != state.pendingSector) {
+            state.pendingSector = sector;
+            state.pendingTurn = 1;
+        } else {
+            state.pendingTurn++;
+        }
+        if (state.pendingTurn && state.pendingTurn >= debounce) {
+            state.sector = sector;
+            state.pendingTurn = 0;
+            if (config.events & kEventDirection) {
+                fireEvent(frame, r, kEventDirection, motionX, motionY);
+            }
+        }
+    }
+}
+
+void TrackingBuffer::fireEvent(const Frame_t &frame, unsigned rule, uint32_t type, float motionX, float motionY)
+{
+    PendingEvent_t event;
+    event.rule = rule;
+    event.type = type;
+    event.frame_index = frame.frame_index;
+    event.timestamp = frame.timestamp;
+    event.timestamp_ns = frame.timestamp_ns;
+    event.motionX = motionX;
+    event.motionY = motionY;
+    mPendingEvents.push_back(event);
+}
+
+// Write the pending events into the ring and publish them all at once
+void TrackingBuffer::publishEvents()
+{
+    Events_t& events = header().events;
+    uint32_t counter = events.event_counter.load(memory_order_relaxed);
+
+    for (size_t i = 0; i < mPendingEvents.size(); i++, counter++) {
+        const PendingEvent_t& pending = mPendingEvents[i];
+        Event_t& slot = events.ring[counter & (kEventRingSize - 1)];
+        slot.lock.beginWrite();
+        slot.event_index = counter;
+        slot.rule = pending.rule;
+        slot.type = pending.type;
+        slot.frame_index = pending.frame_index;
+        slot.timestamp = pending.timestamp;
+        slot.timestamp_ns = pending.timestamp_ns;
+        slot.motionX = pending.motionX;
+        slot.motionY = pending.motionY;
+        slot.lock.endWrite();
+    }
+
+    mPendingEvents.clear();
+    events.event_counter.store(counter, memory_order_release);
+}
+
+void TrackingBuffer::readClients(vector<ClientStats_t> &clients) const
+{
+    const Header_t& header = this->header();
+    uint32_t frame_counter = header.status.frame_counter.load(memory_order_acquire);
+    int64_t now = clock_monotonic_ns();
+
+    clients.clear();
+    for (unsigned i = 0; i < kMaxClients; i++) {
+        ClientStats_t stats;
+        if (header.clients[i].stats(frame_counter, now, stats)) {
+            clients.push_back(stats);
+        }
+    }
+}
+
+vector<TrackingBuffer::ClientStats_t> TrackingBuffer::reapClients()
+{
+    Header_t& header = this->header();
+    uint32_t frame_counter = header.status.frame_counter.load(memory_order_acquire);
+    int64_t now = clock_monotonic_ns();
+    vector<ClientStats_t> reaped;
+
+    for (unsigned i = 0; i < kMaxClients; i++) {
+        ClientSlot_t& slot = header.clients[i];
+        ClientStats_t stats;
+        if (slot.stats(frame_counter, now, stats) && stats.idle_ns >= kClientReapNs) {
+            // If the client comes back, its next report notices the owner has changed
+            slot.heartbeat_ns.store(0, memory_order_relaxed);
+            uint32_t expected = stats.owner;
+            if (slot.owner.compare_exchange_strong(expected, 0)) {
+                reaped.push_back(stats);
+            }
+        }
+    }
+    return reaped;
+}
+
+void TrackingBuffer::readTotalMotion(float &x, float &y) const
+{
+    const Header_t& header = this->header();
+    uint32_t seq;
+    do {
+        seq = header.status.total_motion_lock.readBegin();
+        x = header.status.total_motionX;
+        y = header.status.total_motionY;
+    } while (header.status.total_motion_lock.readRetry(seq));
+}
+
+void TrackingBuffer::publishFrame(uint32_t frame_counter)
+{
+    Header_t& header = this->header();
+    header.status.frame_counter.store(frame_counter, memory_order_release);
+
+    // Events come after their frame, so a client woken by one can always read the frame
+    bool newEvents = !mPendingEvents.empty();
+    if (newEvents) {
+        publishEvents();
+    }
+
+    // Pairs with the fence in waitForCounter(): either the waiter sees the new counter,
+    // or we see the waiter and wake it up.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (header.frame_waiters.load(memory_order_relaxed)) {
+        futex_wake_all(&header.status.frame_counter);
+    }
+    if (newEvents && header.events.event_waiters.load(memory_order_relaxed)) {
+        futex_wake_all(&header.events.event_counter);
+    }
+}
+
+void TrackingBuffer::Frame_t::init(double timestamp, int64_t timestamp_ns)
 {
     this->timestamp = timestamp;
+    this->timestamp_ns = timestamp_ns;
+    memset(cell_start, 0, sizeof cell_start);
+    memset(motion_field, 0, sizeof motion_field);
     num_points = 0;
+    motionX = 0.f;
+    motionY = 0.f;
+}
+
+void TrackingBuffer::Frame_t::updateLumaStats()
+{
+    // Summarize the histogram that yuv422_to_rgbl() accumulated during conversion,
+    // so clients can make exposure decisions without touching pixel memory.
+
+    uint64_t sum = 0;
+    uint32_t under = 0, over = 0;
 
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t count = luma_histogram[i];
+        sum += uint64_t(count) * i;
+        if (i <= kUnderexposedLuma) {
+            under += count;
+        }
+        if (i >= kOverexposedLuma) {
+            over += count;
+        }
+    }
+
+    const float scale = 1.0f / (kWidth * kHeight);
+    luma_mean = sum * scale;
+    underexposed_fraction = under * scale;
+    overexposed_fraction = over * scale;
+}
+
+void TrackingBuffer::Pixels_t::updatePreviews()
+{
+    // Each preview level is filtered from the one above it, so the full-resolution
+    // image is only read once and the second pass stays in cache.
+    bgrl_downsample_2x(pixels, pixels_half, kWidth, kHeight);
+    bgrl_downsample_2x(pixels_half, pixels_quarter, kHalfWidth, kHalfHeight);
 }
 
-void TrackingBuffer::Frame_t::trackPoints(const Frame_t &previous)
+void TrackingBuffer::Frame_t::trackPoints(const Frame_t &previous, const Pixels_t &previousPixels, const Pixels_t &pixels)
 {
-    // Run OpenCV's LK tracker, adapting input and output to our Point_t format.
+    // Run OpenCV's LK tracker, adapting input and output to our Points_t format.
     // This can delete points from frame to frame but never add new points.
     
-    Mat imageA(kHeight, kWidth, CV_8UC4, (void*)previous.pixels);
-    Mat imageB(kHeight, kWidth, CV_8UC4, (void*)pixels);
+    Mat imageA(kHeight, kWidth, CV_8UC4, (void*)previousPixels.pixels);
+    Mat imageB(kHeight, kWidth, CV_8UC4, (void*)pixels.pixels);
     
     vector<Point2f> pointsA, pointsB;
     for (unsigned i = 0; i < previous.num_points; i++) {
-        pointsA.push_back(Point2f(previous.points[i].x, previous.points[i].y));
+        pointsA.push_back(Point2f(previous.points.x[i], previous.points.y[i]));
     }
 
     if (!pointsA.size()) {
@@ -80,30 +1060,72 @@ void TrackingBuffer::Frame_t::trackPoints(const Frame_t &previous)
     calcOpticalFlowPyrLK(imageA, imageB, pointsA, pointsB,
                          status, err, winSize, 3, termcrit, 3, minEigThreshold);
 
-    Point2f numerator(0.f, 0.f);
-    float denominator = 0.f;
-    
     for (unsigned i = 0; i < status.size(); i++) {
-        unsigned this_num_points = num_points;
+        unsigned n = num_points;
         const float kDeletePointProbability = 0.001f;
-        if (this_num_points < kMaxTrackingPoints && status[i] && ci::randFloat() > kDeletePointProbability) {
-            Point_t& newpoint = points[this_num_points];
-            newpoint.x = pointsB[i].x;
-            newpoint.y = pointsB[i].y;
-            newpoint.dx = newpoint.x - pointsA[i].x;
-            newpoint.dy = newpoint.y - pointsA[i].y;
-            newpoint.age = previous.points[i].age + 1;
-            newpoint.last_index = i;
-            num_points = this_num_points + 1;
-
-            // Weighted motion averaging
-            float weight = (newpoint.age - kPointTrialPeriod) / err[i];
-            numerator.x += newpoint.dx * weight;
-            numerator.y += newpoint.dy * weight;
-            denominator += weight;
+        if (n < kMaxTrackingPoints && status[i] && ci::randFloat() > kDeletePointProbability) {
+            points.x[n] = pointsB[i].x;
+            points.y[n] = pointsB[i].y;
+            points.dx[n] = pointsB[i].x - pointsA[i].x;
+            points.dy[n] = pointsB[i].y - pointsA[i].y;
+            points.age[n] = previous.points.age[i] + 1;
+            points.link[n] = i;
+            points.id[n] = previous.points.id[i];
+            // Signed, so points still in their trial period come out negative instead of wrapping
+            points.weight[n] = float(int32_t(points.age[n]) - int32_t(kPointTrialPeriod)) / err[i];
+            num_points = n + 1;
+
+            // Accumulate the motion field while this point is still in registers
+            int cx = int(points.x[n] * kMotionFieldWidth / kWidth);
+            int cy = int(points.y[n] * kMotionFieldHeight / kHeight);
+            MotionCell_t& cell = motion_field[
+                std::min<int>(std::max<int>(cx, 0), kMotionFieldWidth - 1) +
+                std::min<int>(std::max<int>(cy, 0), kMotionFieldHeight - 1) * kMotionFieldWidth];
+            cell.count++;
+            if (points.weight[n] > 0.f) {
+                cell.dx += points.dx[n] * points.weight[n];
+                cell.dy += points.dy[n] * points.weight[n];
+                cell.weight += points.weight[n];
+            }
         }
     }
-    
+
+    for (unsigned c = 0; c < kMotionFieldWidth * kMotionFieldHeight; c++) {
+        MotionCell_t& cell = motion_field[c];
+        if (cell.weight > 0.f) {
+            cell.dx /= cell.weight;
+            cell.dy /= cell.weight;
+        }
+    }
+
+    padPoints();
+    updatePointIndex();
+    unsigned padded = (num_points + kPointVectorWidth - 1) & ~(kPointVectorWidth - 1);
+
+    // Weighted motion averaging, as a separate pass over contiguous arrays. Independent
+    // partial sums for each lane let the compiler vectorize this without reordering
+    // floating point math. Points still in their trial period have negative weights, and
+    // are clamped to zero so they pull on the mean no more than the field does.
+
+    float sumX[kPointVectorWidth] = {0}, sumY[kPointVectorWidth] = {0}, sumW[kPointVectorWidth] = {0};
+
+    for (unsigned i = 0; i < padded; i += kPointVectorWidth) {
+        for (unsigned lane = 0; lane < kPointVectorWidth; lane++) {
+            float w = std::max(points.weight[i + lane], 0.f);
+            sumX[lane] += points.dx[i + lane] * w;
+            sumY[lane] += points.dy[i + lane] * w;
+            sumW[lane] += w;
+        }
+    }
+
+    Point2f numerator(0.f, 0.f);
+    float denominator = 0.f;
+    for (unsigned lane = 0; lane < kPointVectorWidth; lane++) {
+        numerator.x += sumX[lane];
+        numerator.y += sumY[lane];
+        denominator += sumW[lane];
+    }
+
     if (denominator > 0.f) {
         motionX = numerator.x / denominator;
         motionY = numerator.y / denominator;
@@ -113,58 +1135,108 @@ void TrackingBuffer::Frame_t::trackPoints(const Frame_t &previous)
     }
 }
 
-ci::Color8u TrackingBuffer::Frame_t::getPixel(int x, int y) const
+void TrackingBuffer::Frame_t::padPoints()
 {
-    assert(x >= 0 && x < kWidth && y >= 0 && y < kHeight);
-    uint32_t pixel = pixels[x + y * kWidth];
-    return ci::Color8u::hex(pixel);
+    // Zero the unused tail of the last vector block in each array
+    unsigned padded = (num_points + kPointVectorWidth - 1) & ~(kPointVectorWidth - 1);
+    for (unsigned i = num_points; i < padded; i++) {
+        points.x[i] = 0.f;
+        points.y[i] = 0.f;
+        points.dx[i] = 0.f;
+        points.dy[i] = 0.f;
+        points.age[i] = 0;
+        points.link[i] = 0;
+        points.id[i] = 0;
+        points.weight[i] = 0.f;
+    }
 }
 
-bool TrackingBuffer::Frame_t::newPoint(const Frame_t &previous)
+void TrackingBuffer::Frame_t::updateTrackHash()
 {
-    /*
-     * Look for more points to track. We specifically want to focus on areas that are moving,
-     * as a fast alternative to actual background subtraction. We also want to avoid points
-     * too near to any existing d ones.
-     *
-     * To quickly find some interesting points, I further decimate the image into a sparse
-     * grid, and look for image corners near the grid points that have the most motion.
-     */
+    for (unsigned i = 0; i < kTrackHashSize; i++) {
+        track_hash[i] = kTrackHashEmpty;
+    }
+    for (unsigned i = 0; i < num_points; i++) {
+        unsigned slot = trackHash(points.id[i]);
+        while (track_hash[slot] != kTrackHashEmpty) {
+            slot = (slot + 1) & (kTrackHashSize - 1);
+        }
+        track_hash[slot] = i;
+    }
+}
 
-    const unsigned kDiscoveryGridSpacing = 5;
-    const unsigned kGridWidth = kWidth / kDiscoveryGridSpacing;
-    const unsigned kGridHeight = kHeight / kDiscoveryGridSpacing;
-    
-    vector<bool> gridCoverage;
-    gridCoverage.resize(kGridWidth * kGridHeight);
-    fill(gridCoverage.begin(), gridCoverage.end(), false);
-    
-    // Calculate coverage of the discovery grid
-    for (unsigned i = 0; i < num_points && i < kMaxTrackingPoints; i++) {
-        const Point_t& p = points[i];
-        int x = p.x / kDiscoveryGridSpacing;
-        int y = p.y / kDiscoveryGridSpacing;
-        unsigned idx = x + y * kGridWidth;
-        if (idx < gridCoverage.size()) {
-            gridCoverage[idx] = true;
+void TrackingBuffer::Frame_t::updatePointIndex()
+{
+    // Counting sort by cell. Count into cell_start[c + 1], turn counts into starting
+    // positions, then use each start as a cursor while placing points; afterwards every
+    // cursor has advanced to the next cell's start, so shift them back by one.
+
+    uint16_t cells[kMaxTrackingPoints];
+    unsigned n = min<unsigned>(num_points, 0+kMaxTrackingPoints);
+
+    memset(cell_start, 0, sizeof cell_start);
+    for (unsigned i = 0; i < n; i++) {
+        cells[i] = pointCell(points.x[i], points.y[i]);
+        cell_start[cells[i] + 1]++;
+    }
+    for (unsigned c = 0; c < kPointIndexCells; c++) {
+        cell_start[c + 1] += cell_start[c];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        cell_points[cell_start[cells[i]]++] = i;
+    }
+    memmove(cell_start + 1, cell_start, kPointIndexCells * sizeof cell_start[0]);
+    cell_start[0] = 0;
+}
+
+int TrackingBuffer::Frame_t::findTrack(uint64_t id) const
+{
+    // The table is never more than half full, so there is always an empty slot to stop at
+    for (unsigned slot = trackHash(id);; slot = (slot + 1) & (kTrackHashSize - 1)) {
+        unsigned index = track_hash[slot];
+        if (index == kTrackHashEmpty) {
+            return -1;
+        }
+        if (index < kMaxTrackingPoints && points.id[index] == id) {
+            return index;
         }
     }
+}
+
+ci::Color8u TrackingBuffer::Pixels_t::getPixel(int x, int y) const
+{
+    assert(x >= 0 && x < kWidth && y >= 0 && y < kHeight);
+    uint32_t pixel = pixels[x + y * kWidth];
+    return ci::Color8u::hex(pixel);
+}
+
+// The discovery grid for newPoint(). Grid cells are point index cells, so a cell is covered
+// when the index has any points in it. Returns the largest squared color difference found,
+// or zero if nothing on the grid has moved.
+
+static int findDiscoveryPoint(const uint32_t *pixels, const uint32_t *previous,
+                              const uint16_t *cellStart, Point2f &bestPoint)
+{
+    const unsigned kDiscoveryGridSpacing = TrackingBuffer::kPointIndexCellSize;
+    const unsigned kGridWidth = TrackingBuffer::kWidth / kDiscoveryGridSpacing;
+    const unsigned kGridHeight = TrackingBuffer::kHeight / kDiscoveryGridSpacing;
     
     // Look for the highest-motion point that isn't already on the grid, ignoring image edges.
     
-    Point2f bestPoint = Point2f(0, 0);
     int bestDiff = 0;
     
-    for (int y = 1; y < kGridHeight - 1; y++) {
-        for (int x = 1; x < kGridWidth - 1; x++) {
-            if (!gridCoverage[x + y * kGridWidth]) {
+    for (unsigned y = 1; y < kGridHeight - 1; y++) {
+        for (unsigned x = 1; x < kGridWidth - 1; x++) {
+            unsigned cell = x + y * kGridWidth;
+            if (cellStart[cell] == cellStart[cell + 1]) {
                 
                 // Random sampling bias, to avoid creating identical tracking points
                 const float s = kDiscoveryGridSpacing * 0.4;
                 int pixX = x * kDiscoveryGridSpacing + ci::randFloat(-s, s);
                 int pixY = y * kDiscoveryGridSpacing + ci::randFloat(-s, s);
                 
-                int diff2 = getPixel(pixX, pixY).distanceSquared(previous.getPixel(pixX, pixY));
+                unsigned offset = pixX + pixY * TrackingBuffer::kWidth;
+                int diff2 = ci::Color8u::hex(pixels[offset]).distanceSquared(ci::Color8u::hex(previous[offset]));
                 
                 if (diff2 > bestDiff) {
                     bestDiff = diff2;
@@ -173,10 +1245,28 @@ bool TrackingBuffer::Frame_t::newPoint(const Frame_t &previous)
             }
         }
     }
+
+    return bestDiff;
+}
+
+bool TrackingBuffer::Frame_t::newPoint(const Frame_t &previous, const Pixels_t &previousPixels, const Pixels_t &pixels,
+                                       uint64_t &nextTrackId)
+{
+    /*
+     * Look for more points to track. We specifically want to focus on areas that are moving,
+     * as a fast alternative to actual background subtraction. We also want to avoid points
+     * too near to any existing d ones.
+     *
+     * To quickly find some interesting points, I further decimate the image into a sparse
+     * grid, and look for image corners near the grid points that have the most motion.
+     */
+
+    Point2f bestPoint = Point2f(0, 0);
+    int bestDiff = findDiscoveryPoint(pixels.pixels, previousPixels.pixels, cell_start, bestPoint);
     
     if (bestDiff > 0) {
         // Find a good corner near this point
-        Mat image(kHeight, kWidth, CV_8UC4, (void*)pixels);
+        Mat image(kHeight, kWidth, CV_8UC4, (void*)pixels.pixels);
         Mat bgrl[4];
         cv::split(image, bgrl);
 
@@ -186,14 +1276,18 @@ bool TrackingBuffer::Frame_t::newPoint(const Frame_t &previous)
         newPoint.push_back(bestPoint);
         cv::cornerSubPix(bgrl[3], newPoint, subPixWinSize, cv::Size(-1,-1), termcrit);
 
-        Point_t& point = points[num_points];
-        point.x = newPoint[0].x;
-        point.y = newPoint[0].y;
-        point.dx = 0.0f;
-        point.dy = 0.0f;
-        point.age = 0;
-        point.last_index = -1;
-        num_points++;
+        unsigned n = num_points;
+        points.x[n] = newPoint[0].x;
+        points.y[n] = newPoint[0].y;
+        points.dx[n] = 0.0f;
+        points.dy[n] = 0.0f;
+        points.age[n] = 0;
+        points.link[n] = -1;
+        points.id[n] = nextTrackId++;
+        points.weight[n] = 0.f;
+        num_points = n + 1;
+        padPoints();
+        updatePointIndex();
         return true;
     }
     
@@ -3,33 +3,392 @@
 
 #pragma once
 
+#include <string.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
-#include "cinder/Color.h"
-#include "ps3eye.h"
+#ifdef _WIN32
+#include <boost/interprocess/windows_shared_memory.hpp>
+#else
+#include <boost/interprocess/shared_memory_object.hpp>
+#endif
+#include "futex.h"
+
+// Alignment for shared memory arrays that producers and clients process with SIMD
+#ifdef _MSC_VER
+#define TRACKING_ALIGN(n) __declspec(align(n))
+#else
+#define TRACKING_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+// Only TrackingBuffer.cpp needs the definition, so clients can use this header without Cinder
+namespace cinder {
+    template <typename T> class ColorT;
+    typedef ColorT<uint8_t> Color8u;
+}
+namespace ci = cinder;
 
 
 class TrackingBuffer {
 public:
-    bool open(const char *filename);
-    
-    // Number of frames the buffer can hold, as a power of two
-    static const unsigned kNumFramesLog2 = 5;
-    static const unsigned kNumFrames = 1 << kNumFramesLog2;
+    struct Options {
+        enum Backing {
+            kSharedMemory,      // Named shared memory, never written back to disk (default)
+            kFile,              // Memory-mapped disk file, for keeping a copy after a crash
+        };
+
+        Backing backing;
+        std::string name;       // Shared memory object name, or file path
+        bool huge_pages;        // Ask for transparent huge pages, where supported (Linux)
+        bool prefault;          // Touch every page up front instead of faulting during capture
+        bool lock_memory;       // Lock the buffer into RAM so it can never be paged out
+        bool attach;            // Continue an existing buffer with the same layout, if there is one
+        unsigned num_frames;    // Ring depth, rounded up to a power of two
+        unsigned history_frames;    // History ring depth, rounded up to a power of two
+
+        Options();
+    };
+
+    static const char *kDefaultSharedMemoryName;
+
+    // Limits on the ring depth. At 187 fps, 32 frames is 171 ms and 8192 frames is 44 seconds.
+    static const unsigned kMinFrames = 8;
+    static const unsigned kMaxFrames = 8192;
+    static const unsigned kDefaultFrames = 32;
+
+    // Limits on the history ring, which keeps only timestamps, motion, and compact point
+    // records. 8192 frames is 44 seconds, and 1M frames is 93 minutes.
+    static const unsigned kMinHistoryFrames = 8;
+    static const unsigned kMaxHistoryFrames = 1 << 20;
+    static const unsigned kDefaultHistoryFrames = 8192;
 
+    // The history point pool is sized for this many points per frame on average. Busier
+    // frames shorten how far back point records go, but never the frame records themselves.
+    static const unsigned kHistoryPointsPerFrame = 256;
+
+    TrackingBuffer();
+    bool open(const Options &options);
+
+    // Did open() continue an existing buffer rather than starting a new one?
+    bool attached() const { return mAttached; }
+
+    // Human readable description of where clients can find the buffer
+    std::string location() const;
+
+    // Non-fatal problems from open(), such as a failure to lock memory
+    const std::vector<std::string>& warnings() const { return mWarnings; }
+    
     static const unsigned kWidth = 320;
     static const unsigned kHeight = 240;
     static const unsigned kFPS = 187;
+
+    // Box-filtered previews at half and quarter resolution
+    static const unsigned kHalfWidth = kWidth / 2;
+    static const unsigned kHalfHeight = kHeight / 2;
+    static const unsigned kQuarterWidth = kWidth / 4;
+    static const unsigned kQuarterHeight = kHeight / 4;
     
     static const unsigned kMaxTrackingPoints = 1024;
     static const unsigned kPointTrialPeriod = 2;
+
+    // Point arrays are padded with zeroes to a multiple of this many entries, one 64-byte cache line
+    // of floats, so vectorized loops can always run on whole blocks.
+    static const unsigned kPointVectorWidth = 16;
+
+    // Open-addressed table from track ID to point index, published with each frame.
+    // Kept at most half full so lookups rarely probe more than one or two slots.
+    static const unsigned kTrackHashSize = kMaxTrackingPoints * 2;
+    static const uint16_t kTrackHashEmpty = 0xFFFF;
+
+    // Uniform grid index of each frame's points. Cells are the same size as the discovery
+    // grid newPoint() uses, so the index doubles as its coverage map.
+    static const unsigned kPointIndexCellSize = 5;
+    static const unsigned kPointIndexWidth = kWidth / kPointIndexCellSize;
+    static const unsigned kPointIndexHeight = kHeight / kPointIndexCellSize;
+    static const unsigned kPointIndexCells = kPointIndexWidth * kPointIndexHeight;
+
+    // Coarse motion field published with each frame, 20x20 pixel cells at QVGA
+    static const unsigned kMotionFieldWidth = 16;
+    static const unsigned kMotionFieldHeight = 12;
+
+    // Luma limits for exposure statistics, matching the BT.601 video range
+    static const unsigned kUnderexposedLuma = 16;
+    static const unsigned kOverexposedLuma = 235;
     
-    struct Header_t {
-        float total_motionX;
+    // Sequence lock for data with a single writer and any number of readers in other processes.
+    // The counter is odd while a write is in progress. Readers copy the data they need between
+    // readBegin() and readRetry(), and try again if the copy may have been torn.
+
+    struct SeqLock_t {
+        std::atomic<uint32_t> sequence;
+
+        void beginWrite() {
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void endWrite() {
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        uint32_t readBegin() const {
+            return sequence.load(std::memory_order_acquire);
+        }
+
+        bool readRetry(uint32_t start) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return (start & 1) || sequence.load(std::memory_order_relaxed) != start;
+        }
+
+        // Close a write left open by a producer that exited partway through
+        void recover() {
+            if (sequence.load(std::memory_order_relaxed) & 1) {
+                endWrite();
+            }
+        }
+    };
+
+    // Identifies a tracking buffer: "SPDY" in little-endian byte order
+    static const uint32_t kMagic = 0x59445053;
+
+    // Bumped whenever the header or a ring slot changes in any way, including a field added
+    // to Layout_t or to any other header structure. Producers and clients require the whole
+    // layout to match exactly, so any other version is rejected. Layout_t fields are still
+    // only ever appended, so the ones a client reads before checking the version stay put.
+    static const uint32_t kVersion = 7;
+
+    // The buffer is made of segments that clients can map independently, each starting at a
+    // multiple of this alignment (the allocation granularity on Windows, and a whole number of
+    // pages elsewhere):
+    //
+    //   Header segment    Header_t: layout, status, controls, per-client slots
+    //   Points segment    Ring of Frame_t: timestamps, motion, statistics, tracking points
+    //   Pixels segment    Ring of Pixels_t: full resolution and preview images
+    //   History segment   Deep ring of HistoryFrame_t, then a pool of HistoryPoint_t
+    //
+    // Clients that only need motion or points never have to map, or even touch the TLB
+    // entries for, the much larger pixel ring.
+
+    static const uint64_t kSegmentAlignment = 64 << 10;
+
+    // Self-description of the shared memory layout, stored right after the magic and version.
+    // All offsets are in bytes: header fields and segments from the start of the buffer,
+    // frame and pixel fields from the start of their ring slot. Clients should compute
+    // addresses from this table once at attach time rather than hard-coding them.
+
+    struct Layout_t {
+        uint32_t layout_size;                   // sizeof(Layout_t) as written by the producer
+        uint32_t header_size;                   // sizeof(Header_t)
+        uint64_t total_size;                    // Bytes in the whole mapping
+
+        uint32_t width;                         // Camera resolution in pixels
+        uint32_t height;
+        uint32_t fps;                           // Nominal camera frame rate
+        uint32_t num_frames;                    // Ring depth, always a power of two
+        uint32_t max_points;                    // Capacity of each frame's point array
+
+        uint32_t total_motion_offset;           // float X, float Y
+        uint32_t total_motion_lock_offset;      // uint32 sequence
+        uint32_t frame_counter_offset;          // uint32, frames published so far
+        uint32_t min_point_quality_offset;      // float
+        uint32_t camera_controls_offset;        // uint8 autogain, gain, exposure, ... flip_v
+
+        uint64_t header_segment_size;           // The header segment always starts at offset 0
+        uint64_t points_segment_offset;
+        uint64_t points_segment_size;
+        uint64_t pixels_segment_offset;
+        uint64_t pixels_segment_size;
+
+        uint32_t frame_stride;                  // Distance between Frame_t slots in the points segment
+        uint32_t frame_lock_offset;             // uint32 sequence
+        uint32_t frame_index_offset;            // uint32 frame_counter value for this slot
+        uint32_t frame_timestamp_offset;        // double, seconds
+        uint32_t frame_num_points_offset;       // uint32
+        uint32_t frame_motion_offset;           // float X, float Y
+        uint32_t frame_luma_stats_offset;       // float mean, underexposed, overexposed
+        uint32_t frame_luma_histogram_offset;   // uint32[256]
+
+        uint32_t pixels_stride;                 // Distance between Pixels_t slots in the pixels segment
+        uint32_t pixels_lock_offset;            // uint32 sequence
+        uint32_t pixels_frame_index_offset;     // uint32 frame_counter value for this slot
+        uint32_t pixels_full_offset;            // uint32 BGRL pixels, width x height
+        uint32_t pixel_row_stride;              // Bytes per row
+        uint32_t pixels_half_offset;            // uint32 BGRL pixels, (width/2) x (height/2)
+        uint32_t pixels_quarter_offset;         // uint32 BGRL pixels, (width/4) x (height/4)
+
+        uint32_t frame_points_x_offset;         // float[max_points], 64-byte aligned
+        uint32_t frame_points_y_offset;         // float[max_points]
+        uint32_t frame_points_dx_offset;        // float[max_points]
+        uint32_t frame_points_dy_offset;        // float[max_points]
+        uint32_t frame_points_age_offset;       // uint32[max_points]
+        uint32_t frame_points_link_offset;      // uint32[max_points]
+
+        uint32_t status_offset;                 // Status_t, written only by the producer
+        uint32_t controls_offset;               // Controls_t, written only by the producer
+        uint32_t controls_generation_offset;    // uint32, bumped after any control change
+        uint32_t clients_offset;                // ClientSlot_t[max_clients]
+        uint32_t client_stride;                 // sizeof(ClientSlot_t)
+        uint32_t max_clients;
+        uint32_t frame_waiters_offset;          // uint32, clients sleeping on frame_counter
+
+        uint32_t frame_points_id_offset;        // uint64[max_points], 64-byte aligned
+        uint32_t frame_track_hash_offset;       // uint16[track_hash_size], see Frame_t::findTrack()
+        uint32_t track_hash_size;
+        uint32_t next_track_id_offset;          // uint64, in the status region
+
+        uint64_t history_segment_offset;
+        uint64_t history_segment_size;
+        uint32_t history_frames;                // Depth of the history ring, a power of two
+        uint32_t history_frame_stride;          // Distance between HistoryFrame_t slots
+        uint32_t history_lock_offset;           // uint32 sequence
+        uint32_t history_frame_index_offset;    // uint32 frame_counter value for this slot
+        uint32_t history_timestamp_offset;      // double
+        uint32_t history_motion_offset;         // float x, y
+        uint32_t history_num_points_offset;     // uint32
+        uint32_t history_first_point_offset;    // uint64 position in the point pool
+        uint32_t history_points_offset;         // Point pool, from the start of the history segment
+        uint32_t history_points_size;           // Pool capacity in points, a power of two
+        uint32_t history_point_stride;
+        uint32_t history_point_counter_offset;  // uint64 pool write position, in the status region
+        uint32_t epoch_offset;                  // uint32, in the status region
+
+        uint32_t commands_offset;               // Commands_t, see postCommand()
+        uint32_t command_queue_size;            // Number of queue cells and acknowledgements, a power of two
+        uint32_t command_enqueue_pos_offset;    // uint64, claimed by clients with compare-and-swap
+        uint32_t command_completed_offset;      // uint64, written by the producer
+        uint32_t command_queue_offset;          // First Command_t, from the start of Commands_t
+        uint32_t command_stride;
+        uint32_t command_sequence_offset;       // uint64 cell sequence
+        uint32_t command_type_offset;           // uint32 CommandType
+        uint32_t command_param_offset;          // uint32
+        uint32_t command_value_offset;          // double
+        uint32_t command_acks_offset;           // First CommandAck_t, from the start of Commands_t
+        uint32_t command_ack_stride;
+        uint32_t command_ack_ticket_offset;     // uint64, one more than the acknowledged ticket
+        uint32_t command_ack_result_offset;     // double
+
+        uint32_t frame_timestamp_ns_offset;     // int64, monotonic nanoseconds
+        uint32_t history_timestamp_ns_offset;   // int64, monotonic nanoseconds
+        uint32_t clock_lock_offset;             // uint32 sequence, in the status region
+        uint32_t clock_seconds_offset;          // double
+        uint32_t clock_monotonic_offset;        // int64 nanoseconds
+        uint32_t clock_realtime_offset;         // int64 nanoseconds since the Unix epoch
+
+        uint32_t frame_cell_start_offset;       // uint16[index_width * index_height + 1]
+        uint32_t frame_cell_points_offset;      // uint16[max_points], point indices sorted by cell
+        uint32_t index_cell_size;               // Pixels per cell, in both directions
+        uint32_t index_width;                   // Cells per row
+        uint32_t index_height;
+
+        uint32_t frame_motion_field_offset;     // MotionCell_t[field_width * field_height], in rows
+        uint32_t motion_field_width;
+        uint32_t motion_field_height;
+        uint32_t motion_cell_stride;            // float dx, dy, weight; uint32 count
+
+        uint32_t frame_points_weight_offset;    // float[max_points], 64-byte aligned
+
+        uint32_t regions_offset;                // Region_t[max_regions], see claimRegion()
+        uint32_t max_regions;
+        uint32_t region_stride;
+        uint32_t region_owner_offset;           // uint32, zero if free
+        uint32_t region_config_lock_offset;     // uint32 sequence, written by the owning client
+        uint32_t region_type_offset;            // uint32 RegionType
+        uint32_t region_rect_offset;            // float x0, y0, x1, y1
+        uint32_t region_mask_offset;            // uint32[], one bit per point index cell, in rows
+        uint32_t region_motion_lock_offset;     // uint32 sequence, written by the producer
+        uint32_t region_frame_index_offset;     // uint32 frame_counter value of the last update
+        uint32_t region_num_points_offset;      // uint32 points counted on that frame
+        uint32_t region_motion_offset;          // float x, y on that frame
+        uint32_t region_total_offset;           // float x, y integrated since the region was configured
+
+        uint32_t rules_offset;                  // Rule_t[max_rules], see claimRule()
+        uint32_t max_rules;
+        uint32_t rule_stride;
+        uint32_t rule_owner_offset;             // uint32, zero if free
+        uint32_t rule_config_lock_offset;       // uint32 sequence, written by the owning client
+        uint32_t rule_events_offset;            // uint32 EventType bits, zero if the rule is off
+        uint32_t rule_region_offset;            // int32 region index, or -1 for the whole frame
+        uint32_t rule_threshold_offset;         // float threshold, hysteresis in pixels per frame
+        uint32_t rule_debounce_offset;          // uint32 frames
+        uint32_t events_offset;                 // Events_t, see waitForEvent()
+        uint32_t event_counter_offset;          // uint32, events published so far
+        uint32_t event_waiters_offset;          // uint32, clients sleeping on event_counter
+        uint32_t event_ring_offset;             // First Event_t, from the start of Events_t
+        uint32_t event_ring_size;               // A power of two
+        uint32_t event_stride;
+        uint32_t event_lock_offset;             // uint32 sequence
+        uint32_t event_index_offset;            // uint32 event_counter value for this slot
+        uint32_t event_rule_offset;             // uint32 rule index
+        uint32_t event_type_offset;             // uint32 EventType
+        uint32_t event_frame_index_offset;      // uint32 frame the event was detected on
+        uint32_t event_timestamp_offset;        // double, seconds
+        uint32_t event_timestamp_ns_offset;     // int64, monotonic nanoseconds
+        uint32_t event_motion_offset;           // float x, y that triggered the event
+
+        uint32_t client_owner_offset;           // uint32, zero if free
+        uint32_t client_next_frame_offset;      // uint32 frame_counter value the client will read next
+        uint32_t client_heartbeat_offset;       // int64 monotonic nanoseconds, zero while registering
+        uint32_t client_consumed_offset;        // uint64 frames
+        uint32_t client_dropped_offset;         // uint64 frames
+        uint32_t client_latency_offset;         // uint32 microseconds: last, then maximum
+        uint32_t client_name_offset;            // char[client_name_size], NUL terminated
+        uint32_t client_name_size;
+
+        uint32_t creation_nonce_offset;         // uint64, in the status region, nonzero
+    };
+
+    // The header is split into cache-line-aligned regions by writer, so that clients
+    // posting commands never bounce the line the producer is publishing through.
+
+    // Ties frame timestamps to the system clocks. Refreshed about once a second, so any
+    // drift between the producer's clock and the system's stays small.
+    struct ClockMapping_t {
+        SeqLock_t lock;
+        double seconds;                         // A frame timestamp...
+        int64_t monotonic_ns;                   // ...and the monotonic and realtime clocks at that moment
+        int64_t realtime_ns;
+    };
+
+    struct Status_t {
+        float total_motionX;                    // Integrated motion, protected by total_motion_lock
         float total_motionY;
-        uint32_t frame_counter;
+        SeqLock_t total_motion_lock;
+        std::atomic<uint32_t> frame_counter;    // Number of frames published, stored with release semantics
+        uint64_t next_track_id;                 // ID for the next new tracking point; IDs start at 1
+        std::atomic<uint64_t> history_point_counter;    // Pool positions claimed so far, see appendHistory()
+        std::atomic<uint32_t> epoch;            // Incremented each time a producer opens the buffer.
+                                                // Timestamps restart from zero in each epoch.
+        ClockMapping_t clock;
+        uint64_t creation_nonce;                // Random, written once when the buffer is created.
+                                                // Frame indices and track IDs only mean anything
+                                                // within one buffer; see TrackingClient::readFrames().
+    };
+
+    // Identifies one of the settings in ControlValues_t, for kCommandSetControl
+    enum ControlId {
+        kControlMinPointQuality,
+        kControlAutogain,
+        kControlGain,
+        kControlExposure,
+        kControlSharpness,
+        kControlHue,
+        kControlAutoWhiteBalance,
+        kControlBrightness,
+        kControlContrast,
+        kControlBlueBalance,
+        kControlRedBalance,
+        kControlFlipH,
+        kControlFlipV,
+        kNumControls
+    };
+
+    struct ControlValues_t {
         float min_point_quality;
         uint8_t camera_autogain;
         uint8_t camera_gain;
@@ -43,38 +402,889 @@ public:
         uint8_t camera_redblc;
         uint8_t camera_flip_h;
         uint8_t camera_flip_v;
+
+        // Access by ControlId. Out of range values are clamped; unknown IDs are ignored by
+        // set() and read as -1 by get().
+        double get(uint32_t id) const;
+        void set(uint32_t id, double value);
+    };
+
+    // Current settings. Only the producer writes these; clients change them by posting
+    // kCommandSetControl, so updates can't race with the producer reading back the camera.
+    struct Controls_t {
+        std::atomic<uint32_t> generation;       // Incremented by the producer after any change below
+        ControlValues_t values;
+
+        void changed() {
+            generation.fetch_add(1, std::memory_order_release);
+        }
     };
+
+    // Commands from clients to the producer, drained once per frame. The queue is a bounded
+    // multi-producer ring where each cell carries its own sequence number, so clients only
+    // contend on enqueue_pos and never block each other. Every command is identified by a
+    // 64-bit ticket, its queue position, and acknowledged with a result.
+    static const unsigned kCommandQueueSize = 64;
+
+    enum CommandType {
+        kCommandSetControl = 1,                 // param: ControlId. Result: the value actually applied
+        kCommandResetMotion,                    // Zero total_motion. Result: 0
+        kCommandResetPoints,                    // Drop all tracking points on the next frame. Result: 0
+        kCommandSnapshot,                       // Save the next frame as an image. Result: its frame_counter
+    };                                          // Unknown commands are acknowledged with a result of -1
+
+    struct Command_t {
+        std::atomic<uint64_t> sequence;         // Position + 1 once the command is ready to run
+        uint32_t type;                          // CommandType
+        uint32_t param;
+        double value;
+    };
+
+    struct CommandAck_t {
+        std::atomic<uint64_t> ticket;           // Ticket + 1 while result is valid, zero while it's rewritten
+        double result;
+    };
+
+    struct Commands_t {
+        std::atomic<uint64_t> enqueue_pos;      // Next ticket to hand out
+        TRACKING_ALIGN(64) std::atomic<uint64_t> completed;    // Every ticket below this has been run
+        TRACKING_ALIGN(64) Command_t queue[kCommandQueueSize];
+        CommandAck_t acks[kCommandQueueSize];
+    };
+
+    // Registry of client processes, one cache line each so clients never share lines with
+    // each other. A client claims a free slot with a compare-and-swap, then reports its
+    // progress as it reads frames, so the producer or a monitor can find slow consumers.
+    // Clients that stop reporting are considered dead, and after a while their slots are freed.
+    static const unsigned kMaxClients = 16;
+    static const unsigned kClientNameSize = 16;
+    static const int64_t kClientTimeoutNs = 2000000000ll;
+    static const int64_t kClientReapNs = 60000000000ll;
+
+    // One client's progress, as seen by the producer or a monitor
+    struct ClientStats_t {
+        uint32_t owner;
+        char name[kClientNameSize];
+        uint32_t lag;                           // Frames published that it hasn't read yet
+        uint64_t frames_consumed;
+        uint64_t frames_dropped;                // Lost to ring wrap before it read them
+        uint32_t latency_us;                    // Capture to consumption, for its latest frame
+        uint32_t max_latency_us;
+        int64_t idle_ns;                        // Time since its last report
+        bool dead;                              // No report for kClientTimeoutNs
+    };
+
+    struct ClientSlot_t {
+        std::atomic<uint32_t> owner;            // Zero if free. Claim with a compare-and-swap, typically to a PID.
+        std::atomic<uint32_t> next_frame;       // frame_counter value of the next frame it will read
+        std::atomic<int64_t> heartbeat_ns;      // Monotonic clock at its last report, zero while (un)registering
+        std::atomic<uint64_t> frames_consumed;
+        std::atomic<uint64_t> frames_dropped;
+        std::atomic<uint32_t> latency_us;
+        std::atomic<uint32_t> max_latency_us;
+        char name[kClientNameSize];             // Written once, before the first heartbeat
+        uint32_t user[2];                       // Private to the owning client
+
+        // Client: record progress. Totals are the client's own running counts, such as a
+        // TrackingClient::Cursor's. Returns false if the slot was freed because the client
+        // had stopped reporting, in which case it should register again.
+        bool report(uint32_t owner, uint32_t next, uint64_t consumed, uint64_t dropped,
+                    int64_t latency_ns, int64_t now_ns) {
+            if (this->owner.load(std::memory_order_relaxed) != owner) {
+                return false;
+            }
+            uint32_t us = uint32_t(std::min<int64_t>(std::max<int64_t>(latency_ns / 1000, 0), 0xFFFFFFFFll));
+            next_frame.store(next, std::memory_order_relaxed);
+            frames_consumed.store(consumed, std::memory_order_relaxed);
+            frames_dropped.store(dropped, std::memory_order_relaxed);
+            latency_us.store(us, std::memory_order_relaxed);
+            if (us > max_latency_us.load(std::memory_order_relaxed)) {
+                max_latency_us.store(us, std::memory_order_relaxed);
+            }
+            heartbeat_ns.store(now_ns, std::memory_order_release);
+            return true;
+        }
+
+        // Anyone: snapshot this slot. Returns false if it's free or still registering.
+        bool stats(uint32_t frameCounter, int64_t now_ns, ClientStats_t &out) const {
+            int64_t heartbeat = heartbeat_ns.load(std::memory_order_acquire);
+            out.owner = owner.load(std::memory_order_relaxed);
+            if (!out.owner || !heartbeat) {
+                return false;
+            }
+            memcpy(out.name, name, sizeof out.name);
+            out.name[kClientNameSize - 1] = '\0';
+            out.lag = frameCounter - next_frame.load(std::memory_order_relaxed);
+            out.frames_consumed = frames_consumed.load(std::memory_order_relaxed);
+            out.frames_dropped = frames_dropped.load(std::memory_order_relaxed);
+            out.latency_us = latency_us.load(std::memory_order_relaxed);
+            out.max_latency_us = max_latency_us.load(std::memory_order_relaxed);
+            out.idle_ns = now_ns - heartbeat;
+            out.dead = out.idle_ns >= kClientTimeoutNs;
+            return true;
+        }
+    };
+
+
+    // Regions of the image with their own integrated motion. A client claims a free region
+    // the same way as a client slot, then describes it as a rectangle or as a mask over the
+    // point index grid. The producer adds up the motion of the points inside each region on
+    // every frame, restarting the totals whenever the region is reconfigured.
+    static const unsigned kMaxRegions = 16;
+    static const unsigned kRegionMaskWords = (kPointIndexCells + 31) / 32;
+
+    enum RegionType {
+        kRegionOff,
+        kRegionRect,                            // Points in [x0, x1) x [y0, y1)
+        kRegionMask,                            // Points in cells whose mask bit is set
+    };
+
+    struct RegionConfig_t {
+        uint32_t type;                          // RegionType
+        float x0, y0, x1, y1;
+        uint32_t mask[kRegionMaskWords];
+
+        bool contains(float x, float y) const;
+    };
+
+    struct RegionMotion_t {
+        uint32_t frame_index;
+        uint32_t num_points;                    // Tracked points inside the region
+        float motionX, motionY;                 // Weighted mean of their motion, as for MotionCell_t
+        float totalX, totalY;
+    };
+
+    struct Region_t {
+        std::atomic<uint32_t> owner;            // Zero if free. Claim with a compare-and-swap, typically to a PID.
+        SeqLock_t config_lock;
+        RegionConfig_t config;
+        TRACKING_ALIGN(64) SeqLock_t motion_lock;
+        RegionMotion_t motion;
+    };
+
+    // Rules the producer checks on every tracked frame, so clients can sleep until something
+    // happens instead of polling motion. A rule watches the speed of the whole frame's motion
+    // or of one region's, and fires events into the event ring as it crosses its threshold.
+    // Events for a frame are published just after the frame itself.
+    static const unsigned kMaxRules = 32;
+    static const unsigned kEventRingSize = 256;
+
+    enum EventType {
+        kEventStart = 1 << 0,                   // Speed reached threshold
+        kEventStop = 1 << 1,                    // Speed fell below threshold - hysteresis
+        kEventDirection = 1 << 2,               // While started, motion moved to another 45 degree sector
+    };
+
+    struct RuleConfig_t {
+        uint32_t events;                        // EventType bits to fire, zero if the rule is off
+        int32_t region;                         // Region to watch, or -1 for the whole frame
+        float threshold;                        // Pixels per frame
+        float hysteresis;
+        uint32_t debounce;                      // Frames a change must last before its event fires
+    };
+
+    struct Rule_t {
+        std::atomic<uint32_t> owner;            // Zero if free. Claim with a compare-and-swap, typically to a PID.
+        SeqLock_t config_lock;
+        RuleConfig_t config;
+    };
+
+    struct Event_t {
+        SeqLock_t lock;                         // Held by the producer while this slot is rewritten
+        uint32_t event_index;                   // Value of event_counter this slot was written for
+        uint32_t rule;
+        uint32_t type;                          // EventType
+        uint32_t frame_index;                   // Frame the event was detected on
+        double timestamp;                       // That frame's timestamps
+        int64_t timestamp_ns;
+        float motionX, motionY;                 // Motion the rule saw on that frame
+    };
+
+    // Clients wait on event_counter the same way as on frame_counter, see frame_waiters
+    struct Events_t {
+        std::atomic<uint32_t> event_counter;    // Number of events published, stored with release semantics
+        TRACKING_ALIGN(64) std::atomic<uint32_t> event_waiters;
+        TRACKING_ALIGN(64) Event_t ring[kEventRingSize];
+    };
+
+    struct Header_t {
+        uint32_t magic;                         // kMagic, written last once the header is valid,
+                                                // and cleared once a new buffer replaces this one
+        uint32_t version;                       // kVersion
+        Layout_t layout;
+
+        TRACKING_ALIGN(64) Status_t status;
+        TRACKING_ALIGN(64) Controls_t controls;
+        TRACKING_ALIGN(64) ClientSlot_t clients[kMaxClients];
+
+        // Clients blocked until frame_counter changes. The producer only makes a wake-up
+        // system call when this is nonzero. On Linux, other languages can join in by
+        // incrementing this, re-checking frame_counter, then sleeping with a
+        // process-shared FUTEX_WAIT on frame_counter and decrementing afterwards.
+        TRACKING_ALIGN(64) std::atomic<uint32_t> frame_waiters;
+
+        TRACKING_ALIGN(64) Commands_t commands;
+        TRACKING_ALIGN(64) Region_t regions[kMaxRegions];
+        TRACKING_ALIGN(64) Rule_t rules[kMaxRules];
+        TRACKING_ALIGN(64) Events_t events;
+    };
+
+    // Client: claim a free slot in the registry, returning its index or -1 if all are in use.
+    // The client starts out having read every frame published so far. These are inline so
+    // that header-only clients can use them.
+    static int registerClient(Header_t &header, uint32_t owner, const char *name, int64_t now_ns) {
+        for (unsigned i = 0; i < kMaxClients; i++) {
+            ClientSlot_t& slot = header.clients[i];
+            uint32_t expected = 0;
+            if (slot.owner.compare_exchange_strong(expected, owner)) {
+                strncpy(slot.name, name ? name : "", kClientNameSize - 1);
+                slot.name[kClientNameSize - 1] = '\0';
+                slot.next_frame.store(header.status.frame_counter.load(std::memory_order_acquire));
+                slot.frames_consumed.store(0, std::memory_order_relaxed);
+                slot.frames_dropped.store(0, std::memory_order_relaxed);
+                slot.latency_us.store(0, std::memory_order_relaxed);
+                slot.max_latency_us.store(0, std::memory_order_relaxed);
+                slot.heartbeat_ns.store(now_ns, std::memory_order_release);
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Client: free a slot. A free slot's heartbeat is always zero, so a new owner is never
+    // mistaken for a dead one before its first report.
+    static void unregisterClient(Header_t &header, int index) {
+        ClientSlot_t& slot = header.clients[index];
+        slot.heartbeat_ns.store(0, std::memory_order_relaxed);
+        slot.owner.store(0, std::memory_order_release);
+    }
+
+    // Client: queue a command for the producer. Returns false if the queue is full. A client
+    // that dies between claiming a cell and filling it in stalls the queue until the buffer
+    // is recreated, so keep the two together.
+    static bool postCommand(Header_t &header, uint32_t type, uint32_t param, double value, uint64_t *ticket) {
+        Commands_t& commands = header.commands;
+        uint64_t pos = commands.enqueue_pos.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Command_t& cell = commands.queue[pos & (kCommandQueueSize - 1)];
+            int64_t lag = int64_t(cell.sequence.load(std::memory_order_acquire) - pos);
+
+            if (lag == 0) {
+                // Cell is free for this position; claim it (on failure, pos is reloaded)
+                if (commands.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.type = type;
+                    cell.param = param;
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    if (ticket) {
+                        *ticket = pos;
+                    }
+                    return true;
+                }
+            } else if (lag < 0) {
+                // The producer hasn't run the command from one lap ago yet
+                return false;
+            } else {
+                // Another client claimed this position first
+                pos = commands.enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Client: has the producer run this command? If it has and the result is still among the
+    // last kCommandQueueSize acknowledgements, it's also stored in *result.
+    static bool commandDone(const Header_t &header, uint64_t ticket, double *result) {
+        const Commands_t& commands = header.commands;
+        if (int64_t(commands.completed.load(std::memory_order_acquire) - ticket) <= 0) {
+            return false;
+        }
+
+        if (result) {
+            const CommandAck_t& ack = commands.acks[ticket & (kCommandQueueSize - 1)];
+            if (ack.ticket.load(std::memory_order_acquire) == ticket + 1) {
+                double value = ack.result;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (ack.ticket.load(std::memory_order_relaxed) == ticket + 1) {
+                    *result = value;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Client: claim a free region for this owner value, returning its index or -1 if all are in use
+    static int claimRegion(Header_t &header, uint32_t owner) {
+        for (unsigned i = 0; i < kMaxRegions; i++) {
+            uint32_t expected = 0;
+            if (header.regions[i].owner.compare_exchange_strong(expected, owner)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static void releaseRegion(Header_t &header, int index) {
+        Region_t& region = header.regions[index];
+        region.config_lock.beginWrite();
+        region.config.type = kRegionOff;
+        region.config_lock.endWrite();
+        region.owner.store(0, std::memory_order_release);
+    }
+
+    // Client: describe a claimed region. Either call restarts the region's totals.
+    static void setRegionRect(Header_t &header, int index, float x0, float y0, float x1, float y1) {
+        Region_t& region = header.regions[index];
+        region.config_lock.beginWrite();
+        region.config.type = kRegionRect;
+        region.config.x0 = x0;
+        region.config.y0 = y0;
+        region.config.x1 = x1;
+        region.config.y1 = y1;
+        region.config_lock.endWrite();
+    }
+
+    static void setRegionMask(Header_t &header, int index, const uint32_t mask[kRegionMaskWords]) {
+        Region_t& region = header.regions[index];
+        region.config_lock.beginWrite();
+        region.config.type = kRegionMask;
+        memcpy(region.config.mask, mask, sizeof region.config.mask);
+        region.config_lock.endWrite();
+    }
+
+    // Consistent copy of a region's latest motion
+    static void readRegionMotion(const Header_t &header, int index, RegionMotion_t &motion) {
+        const Region_t& region = header.regions[index];
+        uint32_t seq;
+        do {
+            seq = region.motion_lock.readBegin();
+            motion = region.motion;
+        } while (region.motion_lock.readRetry(seq));
+    }
     
-    struct Point_t {
-        float x, y;             // Current location, subpixel accuracy
-        float dx, dy;           // Distance from previous location, or zero if new
-        uint32_t age;           // Number of previous frames this point was seen on
-        uint32_t last_index;    // Index in points[] from the last frame, if age != 0
+    // Tracking points, stored as separate arrays so that loops which only need positions or
+    // motion vectors touch only those, and can be vectorized. Entries from num_points up to
+    // the next multiple of kPointVectorWidth are zero.
+
+    struct Points_t {
+        TRACKING_ALIGN(64) float x[kMaxTrackingPoints];         // Current location, subpixel accuracy
+        TRACKING_ALIGN(64) float y[kMaxTrackingPoints];
+        TRACKING_ALIGN(64) float dx[kMaxTrackingPoints];        // Distance from previous location, or zero if new
+        TRACKING_ALIGN(64) float dy[kMaxTrackingPoints];
+        TRACKING_ALIGN(64) uint32_t age[kMaxTrackingPoints];    // Number of previous frames this point was seen on
+        TRACKING_ALIGN(64) uint32_t link[kMaxTrackingPoints];   // Index in the last frame's points, if age != 0
+        TRACKING_ALIGN(64) uint64_t id[kMaxTrackingPoints];     // Unique for the life of the buffer, zero in padding
+        TRACKING_ALIGN(64) float weight[kMaxTrackingPoints];    // Confidence in this point's motion; zero or
+                                                                // negative while new or during its trial period
+    };
+
+    // Images for one frame, in the pixels segment
+    struct Pixels_t {
+        SeqLock_t lock;                         // Held by the producer while this slot is rewritten
+        uint32_t frame_index;                   // Value of frame_counter this slot was written for
+        TRACKING_ALIGN(64) uint32_t pixels[kWidth * kHeight];   // Luminance + RGB
+        uint32_t pixels_half[kHalfWidth * kHalfHeight];
+        uint32_t pixels_quarter[kQuarterWidth * kQuarterHeight];
+
+        void updatePreviews();
+        ci::Color8u getPixel(int x, int y) const;
     };
 
+    // One cell of the motion field. Uses the same weights as motionX/Y, so points still in
+    // their trial period don't count toward the mean.
+    struct MotionCell_t {
+        float dx, dy;                           // Weighted mean motion, or zero if weight is zero
+        float weight;                           // Total weight, usable as a confidence
+        uint32_t count;                         // Tracked points in this cell, whatever their weight
+    };
+
+    // Everything else about one frame, in the points segment
     struct Frame_t {
-        double timestamp;
+        SeqLock_t lock;                         // Held by the producer while this slot is rewritten
+        uint32_t frame_index;                   // Value of frame_counter this slot was written for
+        double timestamp;                       // Seconds since the producer started, see ClockMapping_t
+        int64_t timestamp_ns;                   // Monotonic clock at capture, in nanoseconds (see clock.h)
         uint32_t num_points;
         float motionX, motionY;                 // Weighted motion from all points
-        uint32_t pixels[kWidth * kHeight];      // Luminance + RGB
-        Point_t points[kMaxTrackingPoints];
+        float luma_mean;                        // Average luminance, 0-255
+        float underexposed_fraction;            // Fraction of pixels at or below kUnderexposedLuma
+        float overexposed_fraction;             // Fraction of pixels at or above kOverexposedLuma
+        uint32_t luma_histogram[256];           // Pixel count for each luminance value
+        Points_t points;
+        uint16_t track_hash[kTrackHashSize];    // Point index for each track ID, or kTrackHashEmpty
 
-        void init(double timestamp);
-        void trackPoints(const Frame_t &previous);
-        bool newPoint(const Frame_t &previous);
-        ci::Color8u getPixel(int x, int y) const;
+        // Points in grid cell c are cell_points[cell_start[c]] up to cell_points[cell_start[c + 1]].
+        // Cells are numbered in rows, and points outside the image go in the nearest cell.
+        uint16_t cell_start[kPointIndexCells + 1];
+        uint16_t cell_points[kMaxTrackingPoints];
+
+        MotionCell_t motion_field[kMotionFieldWidth * kMotionFieldHeight];
+
+        void init(double timestamp, int64_t timestamp_ns);
+        void updateLumaStats();
+        void trackPoints(const Frame_t &previous, const Pixels_t &previousPixels, const Pixels_t &pixels);
+        bool newPoint(const Frame_t &previous, const Pixels_t &previousPixels, const Pixels_t &pixels,
+                      uint64_t &nextTrackId);
+        void padPoints();
+        void updateTrackHash();
+        void updatePointIndex();
+
+        static unsigned pointCell(float x, float y) {
+            int cx = std::min<int>(std::max<int>(int(x) / int(kPointIndexCellSize), 0), kPointIndexWidth - 1);
+            int cy = std::min<int>(std::max<int>(int(y) / int(kPointIndexCellSize), 0), kPointIndexHeight - 1);
+            return cx + cy * kPointIndexWidth;
+        }
+
+        // Call fn(index) for every point inside the rectangle [x0, x1) x [y0, y1),
+        // visiting only the grid cells it overlaps
+        template <typename Fn>
+        void forEachPointInRect(float x0, float y0, float x1, float y1, Fn fn) const {
+            unsigned first = pointCell(x0, y0);
+            unsigned last = pointCell(x1, y1);
+            for (unsigned cy = first / kPointIndexWidth; cy <= last / kPointIndexWidth; cy++) {
+                for (unsigned cx = first % kPointIndexWidth; cx <= last % kPointIndexWidth; cx++) {
+                    unsigned c = cx + cy * kPointIndexWidth;
+                    for (unsigned j = cell_start[c]; j < cell_start[c + 1]; j++) {
+                        unsigned i = cell_points[j];
+                        if (points.x[i] >= x0 && points.x[i] < x1 && points.y[i] >= y0 && points.y[i] < y1) {
+                            fn(i);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Index of the point with this track ID, or -1 if it isn't on this frame
+        int findTrack(uint64_t id) const;
+
+        static unsigned trackHash(uint64_t id) {
+            // Fibonacci hashing; IDs are sequential, so spread them over the table
+            return unsigned((id * 0x9E3779B97F4A7C15ull) >> 53) & (kTrackHashSize - 1);
+        }
     };
-    
-    struct SharedMemory_t {
-        Header_t header;
-        Frame_t frames[kNumFrames];
+
+    // Compact point record in the history pool. Motion and age can be recovered by
+    // following the track ID through earlier history frames.
+    struct HistoryPoint_t {
+        uint64_t id;
+        float x, y;
+    };
+
+    // One frame in the history ring, in the history segment
+    struct HistoryFrame_t {
+        SeqLock_t lock;                         // Held by the producer while this slot is rewritten
+        uint32_t frame_index;                   // Value of frame_counter this slot was written for
+        double timestamp;
+        int64_t timestamp_ns;
+        float motionX, motionY;
+        uint32_t num_points;
+        uint64_t first_point;                   // Pool position of this frame's first point record
     };
 
-    SharedMemory_t* data() {
-        return static_cast<SharedMemory_t*>(mMappedRegion.get_address());
+    static uint64_t alignSegment(uint64_t size) {
+        return (size + kSegmentAlignment - 1) & ~(kSegmentAlignment - 1);
+    }
+
+    static uint64_t pointsSegmentOffset() {
+        return alignSegment(sizeof(Header_t));
+    }
+
+    static uint64_t pixelsSegmentOffset(unsigned numFrames) {
+        return pointsSegmentOffset() + alignSegment(uint64_t(numFrames) * sizeof(Frame_t));
+    }
+
+    static uint64_t historySegmentOffset(unsigned numFrames) {
+        return pixelsSegmentOffset(numFrames) + alignSegment(uint64_t(numFrames) * sizeof(Pixels_t));
+    }
+
+    // The history point pool follows the history frame ring, on a cache line boundary
+    static uint64_t historyPointsOffset(unsigned historyFrames) {
+        return (uint64_t(historyFrames) * sizeof(HistoryFrame_t) + 63) & ~uint64_t(63);
+    }
+
+    static uint64_t totalSize(unsigned numFrames, unsigned historyFrames) {
+        return historySegmentOffset(numFrames) + alignSegment(historyPointsOffset(historyFrames)
+            + uint64_t(historyFrames) * kHistoryPointsPerFrame * sizeof(HistoryPoint_t));
+    }
+
+    Header_t& header() {
+        return *static_cast<Header_t*>(mMappedRegion.get_address());
+    }
+
+    const Header_t& header() const {
+        return *static_cast<const Header_t*>(mMappedRegion.get_address());
+    }
+
+    // Ring slots for any frame_counter value
+    Frame_t& frame(uint32_t index) {
+        uint8_t *base = static_cast<uint8_t*>(mMappedRegion.get_address()) + pointsSegmentOffset();
+        return reinterpret_cast<Frame_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    const Frame_t& frame(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address()) + pointsSegmentOffset();
+        return reinterpret_cast<const Frame_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    Pixels_t& pixels(uint32_t index) {
+        uint8_t *base = static_cast<uint8_t*>(mMappedRegion.get_address()) + pixelsSegmentOffset(mNumFrames);
+        return reinterpret_cast<Pixels_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    const Pixels_t& pixels(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address()) + pixelsSegmentOffset(mNumFrames);
+        return reinterpret_cast<const Pixels_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    // History ring slots for any frame_counter value, and pool entries for any position
+    HistoryFrame_t& historyFrame(uint32_t index) {
+        uint8_t *base = static_cast<uint8_t*>(mMappedRegion.get_address()) + historySegmentOffset(mNumFrames);
+        return reinterpret_cast<HistoryFrame_t*>(base)[index & (mHistoryFrames - 1)];
+    }
+
+    const HistoryFrame_t& historyFrame(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address()) + historySegmentOffset(mNumFrames);
+        return reinterpret_cast<const HistoryFrame_t*>(base)[index & (mHistoryFrames - 1)];
+    }
+
+    HistoryPoint_t& historyPoint(uint64_t position) {
+        uint8_t *base = static_cast<uint8_t*>(mMappedRegion.get_address())
+            + historySegmentOffset(mNumFrames) + historyPointsOffset(mHistoryFrames);
+        return reinterpret_cast<HistoryPoint_t*>(base)[position & (numHistoryPoints() - 1)];
+    }
+
+    const HistoryPoint_t& historyPoint(uint64_t position) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address())
+            + historySegmentOffset(mNumFrames) + historyPointsOffset(mHistoryFrames);
+        return reinterpret_cast<const HistoryPoint_t*>(base)[position & (numHistoryPoints() - 1)];
+    }
+
+    unsigned numFrames() const { return mNumFrames; }
+    unsigned numHistoryFrames() const { return mHistoryFrames; }
+    uint64_t numHistoryPoints() const { return uint64_t(mHistoryFrames) * kHistoryPointsPerFrame; }
+
+private:
+    static void initLayout(Layout_t &layout, unsigned numFrames, unsigned historyFrames);
+
+public:
+
+    enum ReadResult {
+        kReadOk,                // Callback saw a consistent copy of the requested frame
+        kReadNotReady,          // Frame hasn't been published yet
+        kReadOverrun,           // Ring has wrapped and the slot now holds a newer frame
+        kReadBusy,              // Slot kept changing underneath us; try again later
+    };
+
+    // Consistent access to one published frame. The callback receives the shared Frame_t
+    // (or Pixels_t) and should copy whatever it needs; it may be called more than once if the
+    // producer overwrote the slot during the copy, and its results are only valid on kReadOk.
+
+    template <typename Fn>
+    ReadResult readFrame(uint32_t index, Fn fn, unsigned maxAttempts = 8) const {
+        return readSlot(frame(index), index, fn, maxAttempts);
+    }
+
+    template <typename Fn>
+    ReadResult readPixels(uint32_t index, Fn fn, unsigned maxAttempts = 8) const {
+        return readSlot(pixels(index), index, fn, maxAttempts);
+    }
+
+private:
+    template <typename Slot, typename Fn>
+    ReadResult readSlot(const Slot &slot, uint32_t index, Fn fn, unsigned maxAttempts) const {
+        for (unsigned attempt = 0; attempt < maxAttempts; attempt++) {
+            if (int32_t(index - header().status.frame_counter.load(std::memory_order_acquire)) >= 0) {
+                return kReadNotReady;
+            }
+            uint32_t seq = slot.lock.readBegin();
+            if (!(seq & 1)) {
+                if (slot.frame_index != index) {
+                    return kReadOverrun;
+                }
+                fn(slot);
+                if (!slot.lock.readRetry(seq)) {
+                    return kReadOk;
+                }
+            }
+        }
+        return kReadBusy;
+    }
+
+public:
+
+    // Consistent copy of a frame from the history ring, with its point records. Points can
+    // expire before their frame record does; if they have, the result is kReadOverrun but
+    // the frame record is still filled in.
+    ReadResult readHistory(uint32_t index, HistoryFrame_t &frame, std::vector<HistoryPoint_t> &points) const;
+
+    // Producer: record a finished frame in the history ring, before publishing it
+    void appendHistory(const Frame_t &frame);
+
+    // Client: the static versions above, on this buffer
+    bool postCommand(uint32_t type, uint32_t param = 0, double value = 0, uint64_t *ticket = 0) {
+        return postCommand(header(), type, param, value, ticket);
+    }
+
+    bool commandDone(uint64_t ticket, double *result = 0) const {
+        return commandDone(header(), ticket, result);
+    }
+
+    // Producer: run every ready command in order. The callback takes a const Command_t&
+    // and returns the result to acknowledge it with. Returns the number of commands run.
+    template <typename Fn>
+    unsigned drainCommands(Fn fn) {
+        Commands_t& commands = header().commands;
+        uint64_t pos = commands.completed.load(std::memory_order_relaxed);
+        unsigned count = 0;
+
+        for (;; pos++, count++) {
+            Command_t& cell = commands.queue[pos & (kCommandQueueSize - 1)];
+            if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+                break;
+            }
+
+            double result = fn(static_cast<const Command_t&>(cell));
+
+            // Acknowledgements are written like a seqlock, so readers never pair a ticket with
+            // a result from the command that later reuses the slot
+            CommandAck_t& ack = commands.acks[pos & (kCommandQueueSize - 1)];
+            ack.ticket.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            ack.result = result;
+            ack.ticket.store(pos + 1, std::memory_order_release);
+
+            // Hand the cell back to clients for the next lap around the ring
+            cell.sequence.store(pos + kCommandQueueSize, std::memory_order_release);
+            commands.completed.store(pos + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // Producer: record that the frame timestamp `seconds` corresponds to these system clock readings
+    void publishClock(double seconds, int64_t monotonic_ns, int64_t realtime_ns);
+
+    // Consistent copy of the current clock mapping
+    void readClock(double &seconds, int64_t &monotonic_ns, int64_t &realtime_ns) const;
+
+    // Convert a frame timestamp to the system clocks, in nanoseconds
+    int64_t timestampToMonotonic(double timestamp) const;
+    int64_t timestampToRealtime(double timestamp) const;
+
+    // Client: the static region functions above, on this buffer
+    int claimRegion(uint32_t owner) {
+        return claimRegion(header(), owner);
+    }
+
+    void releaseRegion(int index) {
+        releaseRegion(header(), index);
+    }
+
+    void setRegionRect(int index, float x0, float y0, float x1, float y1) {
+        setRegionRect(header(), index, x0, y0, x1, y1);
+    }
+
+    void setRegionMask(int index, const uint32_t mask[kRegionMaskWords]) {
+        setRegionMask(header(), index, mask);
+    }
+
+    void readRegionMotion(int index, RegionMotion_t &motion) const {
+        readRegionMotion(header(), index, motion);
+    }
+
+    // Producer: update every configured region from a tracked frame. Totals are only
+    // advanced if integrate is set.
+    void updateRegions(const Frame_t &frame, bool integrate);
+
+    // Client: claim a free rule for this owner value, returning its index or -1 if all are in use
+    static int claimRule(Header_t &header, uint32_t owner) {
+        for (unsigned i = 0; i < kMaxRules; i++) {
+            uint32_t expected = 0;
+            if (header.rules[i].owner.compare_exchange_strong(expected, owner)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static void releaseRule(Header_t &header, int index) {
+        Rule_t& rule = header.rules[index];
+        rule.config_lock.beginWrite();
+        rule.config.events = 0;
+        rule.config_lock.endWrite();
+        rule.owner.store(0, std::memory_order_release);
+    }
+
+    // Client: configure a claimed rule. The rule starts over in the stopped state.
+    static void setRule(Header_t &header, int index, const RuleConfig_t &config) {
+        Rule_t& rule = header.rules[index];
+        rule.config_lock.beginWrite();
+        rule.config = config;
+        rule.config_lock.endWrite();
+    }
+
+    // Consistent copy of an event. Like readFrame(), but for event_counter values.
+    static ReadResult readEvent(const Header_t &header, uint32_t index, Event_t &event) {
+        const Events_t& events = header.events;
+        const Event_t& slot = events.ring[index & (kEventRingSize - 1)];
+
+        for (unsigned attempt = 0; attempt < 8; attempt++) {
+            if (int32_t(index - events.event_counter.load(std::memory_order_acquire)) >= 0) {
+                return kReadNotReady;
+            }
+            uint32_t seq = slot.lock.readBegin();
+            if (!(seq & 1)) {
+                if (slot.event_index != index) {
+                    return kReadOverrun;
+                }
+                event.event_index = slot.event_index;
+                event.rule = slot.rule;
+                event.type = slot.type;
+                event.frame_index = slot.frame_index;
+                event.timestamp = slot.timestamp;
+                event.timestamp_ns = slot.timestamp_ns;
+                event.motionX = slot.motionX;
+                event.motionY = slot.motionY;
+                if (!slot.lock.readRetry(seq)) {
+                    return kReadOk;
+                }
+            }
+        }
+        return kReadBusy;
+    }
+
+    // Sleep until the event with this index has been published, or the timeout (in seconds)
+    // elapses. Returns true if the event is available.
+    static bool waitForEvent(Header_t &header, uint32_t index, double timeout) {
+        return waitForCounter(header, header.events.event_counter, header.events.event_waiters, index, timeout);
+    }
+
+    // Client: the static rule and event functions above, on this buffer
+    int claimRule(uint32_t owner) {
+        return claimRule(header(), owner);
+    }
+
+    void releaseRule(int index) {
+        releaseRule(header(), index);
+    }
+
+    void setRule(int index, const RuleConfig_t &config) {
+        setRule(header(), index, config);
+    }
+
+    ReadResult readEvent(uint32_t index, Event_t &event) const {
+        return readEvent(header(), index, event);
+    }
+
+    bool waitForEvent(uint32_t index, double timeout) {
+        return waitForEvent(header(), index, timeout);
+    }
+
+    // Producer: check every rule against a frame, after updateRegions(). Frames whose motion
+    // isn't integrated are skipped. Events fired here are published by publishFrame().
+    void updateTriggers(const Frame_t &frame, bool integrate);
+
+    // Producer or monitor: snapshot every registered client
+    void readClients(std::vector<ClientStats_t> &clients) const;
+
+    // Producer: free the slots of clients that haven't reported for kClientReapNs, returning
+    // their stats so they can be logged
+    std::vector<ClientStats_t> reapClients();
+
+    // Consistent snapshot of the integrated motion
+    void readTotalMotion(float &x, float &y) const;
+
+    // Producer: make a new frame_counter value visible, then any events fired on that frame,
+    // waking clients in waitForFrame() and waitForEvent()
+    void publishFrame(uint32_t frame_counter);
+
+    // Sleep until the frame with this index has been published, or the timeout (in seconds)
+    // elapses. Returns true if the frame is available, false early if the buffer is replaced.
+    static bool waitForFrame(Header_t &header, uint32_t index, double timeout) {
+        return waitForCounter(header, header.status.frame_counter, header.frame_waiters, index, timeout);
+    }
+
+    bool waitForFrame(uint32_t index, double timeout) {
+        return waitForFrame(header(), index, timeout);
+    }
+
+    // Does this header describe a buffer with our exact layout, in a mapping of the given size?
+    static bool isCompatible(const Header_t &header, uint64_t mappedSize);
+
+    // Has a producer replaced the buffer this header belongs to with a new one? Clients
+    // still mapping it should reopen the buffer by name.
+    static bool isRetired(const Header_t &header) {
+        return *static_cast<const volatile uint32_t*>(&header.magic) != kMagic;
     }
     
 private:
+    Options mOptions;
+    unsigned mNumFrames;
+    unsigned mHistoryFrames;
+    bool mAttached;
+
+    // Producer's copy of each region's configuration, and the sequence it was copied at
+    RegionConfig_t mRegionConfigs[kMaxRegions];
+    uint32_t mRegionSequences[kMaxRegions];
+
+    // Producer's copy of each rule, and where it stands
+    struct RuleState_t {
+        RuleConfig_t config;
+        uint32_t sequence;                      // Config lock sequence the copy was made at
+        bool started;
+        uint32_t pending;                       // Frames a start or stop has lasted so far
+        int sector;                             // Direction of motion while started, 0-7
+        int pendingSector;
+        uint32_t pendingTurn;                   // Frames motion has been in pendingSector so far
+    };
+
+    // Events fired on the frame being captured, waiting for publishFrame()
+    struct PendingEvent_t {
+        uint32_t rule, type, frame_index;
+        double timestamp;
+        int64_t timestamp_ns;
+        float motionX, motionY;
+    };
+
+    RuleState_t mRules[kMaxRules];
+    std::vector<PendingEvent_t> mPendingEvents;
+    std::vector<std::string> mWarnings;
     boost::interprocess::file_mapping mFileMapping;
+#ifdef _WIN32
+    boost::interprocess::windows_shared_memory mSharedMemory;
+#else
+    boost::interprocess::shared_memory_object mSharedMemory;
+#endif
     boost::interprocess::mapped_region mMappedRegion;
+
+    void adviseMemory();
+    bool attachExisting();
+    uint32_t retireExisting();
+    void checkAvailableMemory(uint64_t size);
+    void fireEvent(const Frame_t &frame, unsigned rule, uint32_t type, float motionX, float motionY);
+    void publishEvents();
+
+    // Wait for a counter to pass index, using the protocol described at frame_waiters
+    static bool waitForCounter(const Header_t &header, std::atomic<uint32_t> &counter,
+                               std::atomic<uint32_t> &waiters, uint32_t index, double timeout) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+
+        while (true) {
+            uint32_t value = counter.load(std::memory_order_acquire);
+            if (int32_t(value - index) > 0) {
+                return true;
+            }
+
+            double remaining = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0 || isRetired(header)) {
+                return false;
+            }
+
+            waiters.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (counter.load(std::memory_order_relaxed) == value) {
+                futex_wait(&counter, value, remaining);
+            }
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
 };
\ No newline at end of file
@@ -0,0 +1,565 @@
+#pragma once
+#include <string>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#ifdef _WIN32
+#include <boost/interprocess/windows_shared_memory.hpp>
+#else
+#include <boost/interprocess/shared_memory_object.hpp>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "TrackingBuffer.h"
+#include "clock.h"
+
+// Header-only client for a TrackingBuffer published by another process.
+//
+// This only uses the shared structure definitions from TrackingBuffer.h, never anything
+// from TrackingBuffer.cpp, so it needs nothing linked in beyond what boost::interprocess
+// needs on the platform (librt on Linux).
+//
+// Frames are read in place. A view of a frame is a pointer into the ring plus the slot's
+// lock sequence when the view was taken; once done reading, call valid() to find out
+// whether the producer overwrote the slot in the meantime. Cursors go through every
+// frame in order, retrying torn reads and counting frames lost to ring wrap.
+//
+//   TrackingClient client;
+//   TrackingClient::Cursor cursor;
+//   if (client.open()) {
+//       client.registerClient("example");
+//       cursor = client.cursor();
+//       while (client.waitForFrame(cursor.next, 1.0) || (client.isRetired() && client.reopen())) {
+//           client.readFrames(cursor, [&](const TrackingBuffer::Frame_t &frame) {
+//               // Copy out what you need; called again if the copy was torn
+//           });
+//           client.report(cursor);
+//       }
+//   }
+
+class TrackingClient {
+public:
+    typedef TrackingBuffer::Header_t Header_t;
+    typedef TrackingBuffer::Layout_t Layout_t;
+    typedef TrackingBuffer::Frame_t Frame_t;
+    typedef TrackingBuffer::Pixels_t Pixels_t;
+    typedef TrackingBuffer::HistoryFrame_t HistoryFrame_t;
+    typedef TrackingBuffer::HistoryPoint_t HistoryPoint_t;
+    typedef TrackingBuffer::ReadResult ReadResult;
+
+    static const char *defaultName() { return "speedyeye-tracking-buffer"; }
+
+    // Torn reads are retried this many times before a frame is given up on
+    static const unsigned kMaxAttempts = 8;
+
+    TrackingClient() : mNumFrames(0), mHistoryFrames(0), mClientSlot(-1), mIsFile(false) {}
+    ~TrackingClient() { close(); }
+
+    // Map a buffer in named shared memory, or in a file written with --file. The mapping is
+    // writable so that waitForFrame() can register as a waiter and clients can post commands.
+    bool open(const std::string &name = defaultName()) {
+        using namespace boost::interprocess;
+        close();
+        mName = name;
+        mIsFile = false;
+        try {
+#ifdef _WIN32
+            mSharedMemory = windows_shared_memory(open_only, name.c_str(), read_write);
+#else
+            mSharedMemory = shared_memory_object(open_only, name.c_str(), read_write);
+#endif
+            mMappedRegion = mapped_region(mSharedMemory, read_write);
+        } catch (interprocess_exception &e) {
+            mError = "Can't open " + name + ": " + e.what();
+            return false;
+        }
+        return checkMapping();
+    }
+
+    bool openFile(const std::string &path) {
+        using namespace boost::interprocess;
+        close();
+        mName = path;
+        mIsFile = true;
+        try {
+            mFileMapping = file_mapping(path.c_str(), read_write);
+            mMappedRegion = mapped_region(mFileMapping, read_write);
+        } catch (interprocess_exception &e) {
+            mError = "Can't open " + path + ": " + e.what();
+            return false;
+        }
+        return checkMapping();
+    }
+
+    void close() {
+        unregisterClient();
+        mMappedRegion = boost::interprocess::mapped_region();
+        mNumFrames = 0;
+        mHistoryFrames = 0;
+    }
+
+    bool isOpen() const { return mNumFrames != 0; }
+
+    // Has the producer replaced this buffer with a new one, say after a --fresh restart or
+    // with a different ring depth? Our mapping stays valid, but it will never see another
+    // frame, and waitForFrame() returns false right away.
+    bool isRetired() const { return isOpen() && TrackingBuffer::isRetired(header()); }
+
+    // Map the buffer by the same name or path as last time, and join the registry again if
+    // we were registered. If the new buffer isn't there yet, this returns false and keeps
+    // the old mapping. Otherwise views into the old mapping are invalid afterwards, and
+    // cursors notice the new buffer by its creation nonce and start over.
+    bool reopen() {
+        TrackingClient next;
+        if (!(mIsFile ? next.openFile(mName) : next.open(mName))) {
+            mError = next.error();
+            return false;
+        }
+
+        std::string clientName = mClientName;
+        bool registered = mClientSlot >= 0;
+        close();
+        mMappedRegion.swap(next.mMappedRegion);
+        mSharedMemory.swap(next.mSharedMemory);
+        mFileMapping.swap(next.mFileMapping);
+        std::swap(mNumFrames, next.mNumFrames);
+        std::swap(mHistoryFrames, next.mHistoryFrames);
+        if (registered) {
+            registerClient(clientName.c_str());
+        }
+        return true;
+    }
+
+    // Why the last open() failed
+    const std::string& error() const { return mError; }
+
+    // Can a client built against this TrackingBuffer.h use the buffer in this mapping?
+    // Checks every size and offset that the inline accessors depend on. Sets error.
+    static bool checkLayout(const Header_t &header, uint64_t mappedSize, std::string &error) {
+        const Layout_t &layout = header.layout;
+        unsigned n = layout.num_frames;
+        unsigned h = layout.history_frames;
+
+        if (header.magic != TrackingBuffer::kMagic) {
+            error = "Not a tracking buffer, or the producer is still setting it up";
+        } else if (header.version != TrackingBuffer::kVersion) {
+            error = "Tracking buffer version " + std::to_string(header.version) + ", expected "
+                + std::to_string(TrackingBuffer::kVersion);
+        } else if (layout.layout_size != sizeof(Layout_t) || layout.header_size != sizeof(Header_t)) {
+            error = "Tracking buffer header is from a different build";
+        } else if (layout.width != TrackingBuffer::kWidth || layout.height != TrackingBuffer::kHeight
+            || layout.max_points != TrackingBuffer::kMaxTrackingPoints) {
+            error = "Tracking buffer has a different resolution or point capacity";
+        } else if (n < TrackingBuffer::kMinFrames || n > TrackingBuffer::kMaxFrames || (n & (n - 1))
+            || h < TrackingBuffer::kMinHistoryFrames || h > TrackingBuffer::kMaxHistoryFrames || (h & (h - 1))) {
+            error = "Tracking buffer has an invalid ring depth";
+        } else if (layout.frame_stride != sizeof(Frame_t) || layout.pixels_stride != sizeof(Pixels_t)
+            || layout.history_frame_stride != sizeof(TrackingBuffer::HistoryFrame_t)
+            || layout.points_segment_offset != TrackingBuffer::pointsSegmentOffset()
+            || layout.pixels_segment_offset != TrackingBuffer::pixelsSegmentOffset(n)
+            || layout.history_segment_offset != TrackingBuffer::historySegmentOffset(n)
+            || layout.total_size != TrackingBuffer::totalSize(n, h)) {
+            error = "Tracking buffer segments are laid out differently";
+        } else if (mappedSize < layout.total_size) {
+            error = "Tracking buffer is truncated";
+        } else {
+            return true;
+        }
+        return false;
+    }
+
+    const Header_t& header() const {
+        return *static_cast<const Header_t*>(mMappedRegion.get_address());
+    }
+
+    unsigned numFrames() const { return mNumFrames; }
+    unsigned numHistoryFrames() const { return mHistoryFrames; }
+    uint64_t numHistoryPoints() const { return uint64_t(mHistoryFrames) * TrackingBuffer::kHistoryPointsPerFrame; }
+
+    uint32_t frameCounter() const {
+        return header().status.frame_counter.load(std::memory_order_acquire);
+    }
+
+    // Ring slots for any frame_counter value, with no checks at all
+    const Frame_t& frame(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address())
+            + TrackingBuffer::pointsSegmentOffset();
+        return reinterpret_cast<const Frame_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    const Pixels_t& pixels(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address())
+            + TrackingBuffer::pixelsSegmentOffset(mNumFrames);
+        return reinterpret_cast<const Pixels_t*>(base)[index & (mNumFrames - 1)];
+    }
+
+    // History ring slots for any frame_counter value, and pool entries for any position
+    const HistoryFrame_t& historyFrame(uint32_t index) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address())
+            + TrackingBuffer::historySegmentOffset(mNumFrames);
+        return reinterpret_cast<const HistoryFrame_t*>(base)[index & (mHistoryFrames - 1)];
+    }
+
+    const HistoryPoint_t& historyPoint(uint64_t position) const {
+        const uint8_t *base = static_cast<const uint8_t*>(mMappedRegion.get_address())
+            + TrackingBuffer::historySegmentOffset(mNumFrames) + TrackingBuffer::historyPointsOffset(mHistoryFrames);
+        return reinterpret_cast<const HistoryPoint_t*>(base)[position & (numHistoryPoints() - 1)];
+    }
+
+    // Zero-copy view of a Frame_t or Pixels_t slot
+    template <typename Slot>
+    class View {
+    public:
+        View() : mSlot(0), mSequence(1) {}
+
+        const Slot& operator*() const { return *mSlot; }
+        const Slot* operator->() const { return mSlot; }
+
+        // Lock sequence the view was taken at, for checking validity elsewhere
+        uint32_t sequence() const { return mSequence; }
+
+        // Was everything read through this view so far intact?
+        bool valid() const { return mSlot && !mSlot->lock.readRetry(mSequence); }
+
+    private:
+        friend class TrackingClient;
+        const Slot *mSlot;
+        uint32_t mSequence;
+    };
+
+    typedef View<Frame_t> FrameView;
+    typedef View<Pixels_t> PixelsView;
+
+    // Start reading a published frame in place. On kReadOk the view points at the slot,
+    // which stays intact for as long as valid() says so.
+    ReadResult viewFrame(uint32_t index, FrameView &view) const {
+        return viewSlot(frame(index), index, view);
+    }
+
+    ReadResult viewPixels(uint32_t index, PixelsView &view) const {
+        return viewSlot(pixels(index), index, view);
+    }
+
+    // Consistent copy of a frame record from the history ring
+    ReadResult readHistoryFrame(uint32_t index, HistoryFrame_t &frame) const {
+        const HistoryFrame_t& slot = historyFrame(index);
+        for (unsigned attempt = 0; attempt < kMaxAttempts; attempt++) {
+            if (int32_t(index - frameCounter()) >= 0) {
+                return TrackingBuffer::kReadNotReady;
+            }
+            uint32_t seq = slot.lock.readBegin();
+            if (!(seq & 1)) {
+                if (slot.frame_index != index) {
+                    return TrackingBuffer::kReadOverrun;
+                }
+                frame.frame_index = slot.frame_index;
+                frame.timestamp = slot.timestamp;
+                frame.timestamp_ns = slot.timestamp_ns;
+                frame.motionX = slot.motionX;
+                frame.motionY = slot.motionY;
+                frame.num_points = slot.num_points;
+                frame.first_point = slot.first_point;
+                if (!slot.lock.readRetry(seq)) {
+                    return TrackingBuffer::kReadOk;
+                }
+            }
+        }
+        return TrackingBuffer::kReadBusy;
+    }
+
+    // Copy the point records for a history frame, as many as the pool holds. Returns false
+    // if the pool has wrapped past any of them, in which case the copy is meaningless.
+    bool readHistoryPoints(const HistoryFrame_t &frame, HistoryPoint_t *points) const {
+        uint64_t n = std::min<uint64_t>(frame.num_points, numHistoryPoints());
+        for (uint64_t i = 0; i < n; i++) {
+            points[i] = historyPoint(frame.first_point + i);
+        }
+
+        // Pairs with the fence in TrackingBuffer::appendHistory()
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t claimed = header().status.history_point_counter.load(std::memory_order_relaxed);
+        return claimed - frame.first_point <= numHistoryPoints();
+    }
+
+    // Position in the stream of frames, private to one client
+    struct Cursor {
+        uint32_t next;                          // Next frame to deliver
+        uint64_t nonce;                         // Buffer this cursor belongs to, see Status_t
+        uint32_t epoch;                         // Latest producer epoch seen in that buffer
+        uint64_t delivered;                     // Frames passed to the callback intact
+        uint64_t skipped;                       // Frames lost to ring wrap or to torn reads
+        uint32_t restarts;                      // Times the producer started a new buffer under us
+        int64_t timestamp_ns;                   // Capture time of the last frame delivered, or zero
+    };
+
+    // A cursor that starts with the next frame to be published
+    Cursor cursor() const {
+        Cursor c;
+        c.next = frameCounter();
+        c.nonce = header().status.creation_nonce;
+        c.epoch = header().status.epoch.load(std::memory_order_acquire);
+        c.delivered = 0;
+        c.skipped = 0;
+        c.restarts = 0;
+        c.timestamp_ns = 0;
+        return c;
+    }
+
+    // Call fn(const Frame_t&) for every frame published since the cursor's last read, oldest
+    // first and up to maxFrames of them, reading each in place. As with readFrame(), fn may
+    // be called more than once for a frame if the producer overwrote it during the call, and
+    // only its last call for each frame counts. Returns the number of frames delivered.
+    template <typename Fn>
+    unsigned readFrames(Cursor &c, Fn fn, unsigned maxFrames = ~0u) const {
+        const Header_t& header = this->header();
+        unsigned count = 0;
+
+        // A producer that restarts in attach mode bumps the epoch and keeps counting, so the
+        // cursor carries on. A new buffer has its own frame counter and track IDs, and there's
+        // nothing to do but start over from wherever it is. Frames published before we noticed aren't counted as skipped, as
+        // they were never part of the stream the cursor was following.
+        uint32_t counter = frameCounter();
+        if (header.status.creation_nonce != c.nonce) {
+            c.nonce = header.status.creation_nonce;
+            c.next = counter;
+            c.restarts++;
+        }
+        c.epoch = header.status.epoch.load(std::memory_order_acquire);
+
+        while (count < maxFrames && int32_t(counter - c.next) > 0) {
+            // The slot for frame_counter itself may be in the middle of a rewrite
+            uint32_t oldest = counter - mNumFrames + 1;
+            if (int32_t(c.next - oldest) < 0) {
+                c.skipped += oldest - c.next;
+                c.next = oldest;
+            }
+
+            FrameView view;
+            bool ok = false;
+            for (unsigned attempt = 0; attempt < kMaxAttempts; attempt++) {
+                ReadResult result = viewFrame(c.next, view);
+                if (result == TrackingBuffer::kReadOk) {
+                    fn(*view);
+                    int64_t timestamp_ns = view->timestamp_ns;
+                    if (view.valid()) {
+                        c.timestamp_ns = timestamp_ns;
+                        ok = true;
+                        break;
+                    }
+                } else if (result == TrackingBuffer::kReadOverrun) {
+                    break;
+                }
+            }
+
+            if (ok) {
+                c.delivered++;
+                count++;
+            } else {
+                c.skipped++;
+            }
+            c.next++;
+            counter = frameCounter();
+        }
+        return count;
+    }
+
+    // Sleep until the frame with this index has been published, or the timeout (in seconds)
+    // elapses. Returns true if the frame is available.
+    bool waitForFrame(uint32_t index, double timeout) {
+        return TrackingBuffer::waitForFrame(mutableHeader(), index, timeout);
+    }
+
+    // Join the client registry under this name, so the producer and monitors can see how far
+    // behind we are. Our process ID is the slot owner. Returns false if the registry is full.
+    bool registerClient(const char *name) {
+        unregisterClient();
+        mClientOwner = processId();
+        mClientName = name ? name : "";
+        mClientSlot = TrackingBuffer::registerClient(mutableHeader(), mClientOwner, mClientName.c_str(),
+                                                     clock_monotonic_ns());
+        return mClientSlot >= 0;
+    }
+
+    void unregisterClient() {
+        if (mClientSlot >= 0 && isOpen()) {
+            TrackingBuffer::ClientSlot_t& slot = mutableHeader().clients[mClientSlot];
+            if (slot.owner.load(std::memory_order_relaxed) == mClientOwner) {
+                TrackingBuffer::unregisterClient(mutableHeader(), mClientSlot);
+            }
+        }
+        mClientSlot = -1;
+    }
+
+    // Publish a cursor's progress to our registry slot, typically after each readFrames().
+    // This is also our heartbeat. If the producer freed the slot because we went quiet for
+    // too long, we register again. Returns false if we aren't registered.
+    bool report(const Cursor &c) {
+        if (mClientSlot < 0) {
+            return false;
+        }
+        int64_t now = clock_monotonic_ns();
+        int64_t latency = c.timestamp_ns ? now - c.timestamp_ns : 0;
+        TrackingBuffer::ClientSlot_t& slot = mutableHeader().clients[mClientSlot];
+        if (slot.report(mClientOwner, c.next, c.delivered, c.skipped, latency, now)) {
+            return true;
+        }
+        std::string name = mClientName;
+        mClientSlot = -1;
+        return registerClient(name.c_str()) && report(c);
+    }
+
+    // Snapshot every registered client, for monitoring
+    void readClients(std::vector<TrackingBuffer::ClientStats_t> &clients) const {
+        uint32_t counter = frameCounter();
+        int64_t now = clock_monotonic_ns();
+        clients.clear();
+        for (unsigned i = 0; i < TrackingBuffer::kMaxClients; i++) {
+            TrackingBuffer::ClientStats_t stats;
+            if (header().clients[i].stats(counter, now, stats)) {
+                clients.push_back(stats);
+            }
+        }
+    }
+
+    // Queue a command for the producer, such as TrackingBuffer::kCommandSetControl. Returns
+    // false if the queue is full. The ticket identifies the command to commandDone().
+    bool postCommand(uint32_t type, uint32_t param = 0, double value = 0, uint64_t *ticket = 0) {
+        return TrackingBuffer::postCommand(mutableHeader(), type, param, value, ticket);
+    }
+
+    // Has the producer run this command? If so, its result is stored in *result while the
+    // producer still remembers it.
+    bool commandDone(uint64_t ticket, double *result = 0) const {
+        return TrackingBuffer::commandDone(header(), ticket, result);
+    }
+
+    // Claim a free region with our process ID as its owner, returning its index or -1 if
+    // all are in use. Release it when done; regions aren't reclaimed from dead clients.
+    int claimRegion() {
+        return TrackingBuffer::claimRegion(mutableHeader(), processId());
+    }
+
+    void releaseRegion(int index) {
+        TrackingBuffer::releaseRegion(mutableHeader(), index);
+    }
+
+    // Describe a claimed region, restarting its totals. The mask has a bit for each cell of
+    // the point index grid, cell c in bit c % 32 of word c / 32.
+    void setRegionRect(int index, float x0, float y0, float x1, float y1) {
+        TrackingBuffer::setRegionRect(mutableHeader(), index, x0, y0, x1, y1);
+    }
+
+    void setRegionMask(int index, const uint32_t mask[TrackingBuffer::kRegionMaskWords]) {
+        TrackingBuffer::setRegionMask(mutableHeader(), index, mask);
+    }
+
+    // Consistent copy of a region's latest motion
+    void readRegionMotion(int index, TrackingBuffer::RegionMotion_t &motion) const {
+        TrackingBuffer::readRegionMotion(header(), index, motion);
+    }
+
+    // Claim a free rule with our process ID as its owner, returning its index or -1 if all
+    // are in use. Like regions, rules aren't reclaimed from dead clients.
+    int claimRule() {
+        return TrackingBuffer::claimRule(mutableHeader(), processId());
+    }
+
+    void releaseRule(int index) {
+        TrackingBuffer::releaseRule(mutableHeader(), index);
+    }
+
+    // Configure a claimed rule. It starts over in the stopped state.
+    void setRule(int index, const TrackingBuffer::RuleConfig_t &config) {
+        TrackingBuffer::setRule(mutableHeader(), index, config);
+    }
+
+    // Number of events published so far, for starting to read events from now on
+    uint32_t eventCounter() const {
+        return header().events.event_counter.load(std::memory_order_acquire);
+    }
+
+    // Consistent copy of an event, for any event_counter value
+    ReadResult readEvent(uint32_t index, TrackingBuffer::Event_t &event) const {
+        return TrackingBuffer::readEvent(header(), index, event);
+    }
+
+    // Sleep until the event with this index has been published, or the timeout (in seconds)
+    // elapses. Returns true if the event is available.
+    bool waitForEvent(uint32_t index, double timeout) {
+        return TrackingBuffer::waitForEvent(mutableHeader(), index, timeout);
+    }
+
+    // Consistent snapshot of the integrated motion
+    void readTotalMotion(float &x, float &y) const {
+        const Header_t& header = this->header();
+        uint32_t seq;
+        do {
+            seq = header.status.total_motion_lock.readBegin();
+            x = header.status.total_motionX;
+            y = header.status.total_motionY;
+        } while (header.status.total_motion_lock.readRetry(seq));
+    }
+
+private:
+    std::string mError;
+    unsigned mNumFrames;
+    unsigned mHistoryFrames;
+    int mClientSlot;
+    uint32_t mClientOwner;
+    std::string mClientName;
+    std::string mName;
+    bool mIsFile;
+    boost::interprocess::file_mapping mFileMapping;
+#ifdef _WIN32
+    boost::interprocess::windows_shared_memory mSharedMemory;
+#else
+    boost::interprocess::shared_memory_object mSharedMemory;
+#endif
+    boost::interprocess::mapped_region mMappedRegion;
+
+    Header_t& mutableHeader() {
+        return *static_cast<Header_t*>(mMappedRegion.get_address());
+    }
+
+    // Owner value for our registry slot and anything else we claim
+    static uint32_t processId() {
+#ifdef _WIN32
+        return uint32_t(GetCurrentProcessId());
+#else
+        return uint32_t(getpid());
+#endif
+    }
+
+    bool checkMapping() {
+        if (mMappedRegion.get_size() < sizeof(Header_t)) {
+            mError = "Tracking buffer is truncated";
+        } else if (checkLayout(header(), mMappedRegion.get_size(), mError)) {
+            mNumFrames = header().layout.num_frames;
+            mHistoryFrames = header().layout.history_frames;
+            return true;
+        }
+        close();
+        return false;
+    }
+
+    template <typename Slot>
+    ReadResult viewSlot(const Slot &slot, uint32_t index, View<Slot> &view) const {
+        for (unsigned attempt = 0; attempt < kMaxAttempts; attempt++) {
+            if (int32_t(index - frameCounter()) >= 0) {
+                return TrackingBuffer::kReadNotReady;
+            }
+            uint32_t seq = slot.lock.readBegin();
+            if (!(seq & 1)) {
+                if (slot.frame_index != index) {
+                    return TrackingBuffer::kReadOverrun;
+                }
+                view.mSlot = &slot;
+                view.mSequence = seq;
+                return TrackingBuffer::kReadOk;
+            }
+        }
+        return TrackingBuffer::kReadBusy;
+    }
+};
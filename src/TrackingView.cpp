@@ -17,9 +17,10 @@ void TrackingView::setup()
 
 void TrackingView::draw(TrackingBuffer &buffer)
 {
-    // Draw all previous frames, in temporal order
-    uint32_t frame_counter = buffer.data()->header.frame_counter;
-    uint32_t first_frame = max<int64_t>(0, int64_t(frame_counter) - (buffer.kNumFrames - 1));
+    // Draw recent frames still in the ring, in temporal order
+    uint32_t frame_counter = buffer.header().status.frame_counter;
+    unsigned depth = min<unsigned>(buffer.numFrames(), 0+kMaxOnionSkinFrames);
+    uint32_t first_frame = max<int64_t>(0, int64_t(frame_counter) - (depth - 1));
     for (uint32_t i = first_frame; i < frame_counter; i++) {
         drawFrame(buffer, i, 0.2f);
     }
@@ -29,18 +30,19 @@ void TrackingView::draw(TrackingBuffer &buffer)
 
 void TrackingView::drawFrame(TrackingBuffer &buffer, unsigned index, float alpha)
 {
-    uint8_t ring_index = index & (buffer.kNumFrames - 1);
-    auto& frame = buffer.data()->frames[ring_index];
-    
-    if (mFrameTextures.size() <= ring_index) {
-        mFrameTextures.resize(ring_index + 1);
+    auto& frame = buffer.frame(index);
+
+    // Textures are cached per onion skin layer, not per ring slot
+    unsigned cache_index = index % kMaxOnionSkinFrames;
+    if (mFrameTextures.size() <= cache_index) {
+        mFrameTextures.resize(cache_index + 1);
     }
-    auto& tex = mFrameTextures[ring_index];
+    auto& tex = mFrameTextures[cache_index];
 
     if (tex.first != index || !tex.second) {
         // Upload texture, update index stamp
         tex.first = index;
-        tex.second = gl::Texture::create((unsigned char *) frame.pixels, GL_BGRA, buffer.kWidth, buffer.kHeight);
+        tex.second = gl::Texture::create((unsigned char *) buffer.pixels(index).pixels, GL_BGRA, buffer.kWidth, buffer.kHeight);
     }
     
     gl::enableAlphaBlending();
@@ -55,9 +57,8 @@ void TrackingView::drawFrame(TrackingBuffer &buffer, unsigned index, float alpha
     glPointSize(5);
     gl::begin(GL_POINTS);
     for (unsigned i = 0; i < num_points; i++) {
-        if (frame.points[i].age >= TrackingBuffer::kPointTrialPeriod) {
-            auto& point = frame.points[i];
-            Vec2f pos(point.x, point.y);
+        if (frame.points.age[i] >= TrackingBuffer::kPointTrialPeriod) {
+            Vec2f pos(frame.points.x[i], frame.points.y[i]);
             gl::vertex(pos);
         }
     }
@@ -67,10 +68,9 @@ void TrackingView::drawFrame(TrackingBuffer &buffer, unsigned index, float alpha
     gl::lineWidth(1);
     gl::color(1.0f, 1.0f, 1.0f, 1.0f);
     for (unsigned i = 0; i < num_points; i++) {
-        if (frame.points[i].age >= TrackingBuffer::kPointTrialPeriod) {
-            auto& point = frame.points[i];
-            Vec2f pos(point.x, point.y);
-            Vec2f delta(point.dx, point.dy);
+        if (frame.points.age[i] >= TrackingBuffer::kPointTrialPeriod) {
+            Vec2f pos(frame.points.x[i], frame.points.y[i]);
+            Vec2f delta(frame.points.dx[i], frame.points.dy[i]);
             gl::drawLine(pos-delta, pos);
         }
     }
@@ -86,9 +86,12 @@ static float fmod_positive(float n, float d)
 
 void TrackingView::drawTotalMotion(TrackingBuffer &buffer)
 {
+    float totalX, totalY;
+    buffer.readTotalMotion(totalX, totalY);
+
     // Wrap around screen edges
-    Vec2f pos(fmod_positive(buffer.data()->header.total_motionX, buffer.kWidth),
-              fmod_positive(buffer.data()->header.total_motionY, buffer.kHeight));
+    Vec2f pos(fmod_positive(totalX, buffer.kWidth),
+              fmod_positive(totalY, buffer.kHeight));
 
     // Pink dot with black outline
     gl::color(0.f, 0.f, 0.f);
@@ -9,6 +9,9 @@
 
 class TrackingView {
 public:
+    // Frames drawn in the onion skin, at most. Deep rings keep far more history than this.
+    static const unsigned kMaxOnionSkinFrames = 32;
+
     void setup();
     void draw(TrackingBuffer &buffer);
     void drawFrame(TrackingBuffer &buffer, unsigned index, float alpha = 1.0f);
@@ -0,0 +1,444 @@
+// Publishes motion and tracking points over UDP (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#include "net.h"
+#include <string.h>
+#include <stdlib.h>
+#include "UdpPublisher.h"
+
+using namespace std;
+
+// Batch size for sendmmsg()
+static const unsigned kSendBatch = 64;
+
+UdpPublisher::Options::Options()
+    : decimation(1),
+      max_points(TrackingBuffer::kMaxTrackingPoints),
+      ttl(1)
+{}
+
+UdpPublisher::UdpPublisher()
+    : mBuffer(0),
+      mSocket(kNetNoSocket),
+      mStopping(false),
+      mPacketsSent(0),
+      mPacketsDropped(0)
+{
+    mSequence[kBinary] = 0;
+    mSequence[kOsc] = 0;
+}
+
+UdpPublisher::~UdpPublisher()
+{
+    stop();
+}
+
+bool UdpPublisher::parseDestination(const string &spec, Format format, Destination &dest)
+{
+    size_t colon = spec.rfind(':');
+    if (colon == string::npos || colon == 0) {
+        return false;
+    }
+    int port = atoi(spec.c_str() + colon + 1);
+    if (port <= 0 || port > 0xFFFF) {
+        return false;
+    }
+    dest.host = spec.substr(0, colon);
+    dest.port = uint16_t(port);
+    dest.format = format;
+    return true;
+}
+
+bool UdpPublisher::start(TrackingBuffer &buffer, const Options &options)
+{
+    stop();
+    mBuffer = &buffer;
+    mOptions = options;
+    mAddresses.clear();
+
+    if (!net_startup()) {
+        mError = "Can't start Winsock";
+        return false;
+    }
+
+    for (auto& dest : options.destinations) {
+        addrinfo hints, *info = 0;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(dest.host.c_str(), 0, &hints, &info) || !info) {
+            mError = "Can't resolve " + dest.host;
+            return false;
+        }
+        Address addr;
+        addr.ip = reinterpret_cast<sockaddr_in*>(info->ai_addr)->sin_addr.s_addr;
+        addr.port = htons(dest.port);
+        addr.format = dest.format;
+        mAddresses.push_back(addr);
+        freeaddrinfo(info);
+    }
+
+    mSocket = intptr_t(socket(AF_INET, SOCK_DGRAM, 0));
+    if (mSocket == kNetNoSocket) {
+        mError = "Can't create a UDP socket";
+        return false;
+    }
+
+    // Never block the publisher either; if the socket buffer is full, that frame is dropped
+    net_set_nonblocking(mSocket);
+#ifdef _WIN32
+    DWORD ttl = options.ttl;
+#else
+    unsigned char ttl = (unsigned char) min(options.ttl, 255u);
+#endif
+    setsockopt(NET_SOCKET(mSocket), IPPROTO_IP, IP_MULTICAST_TTL, (const char*) &ttl, sizeof ttl);
+
+    mFrame.id.resize(options.max_points);
+    mFrame.x.resize(options.max_points);
+    mFrame.y.resize(options.max_points);
+    mFrame.dx.resize(options.max_points);
+    mFrame.dy.resize(options.max_points);
+
+    mStopping = false;
+    mThread = thread(&UdpPublisher::threadFn, this);
+    return true;
+}
+
+void UdpPublisher::stop()
+{
+    mStopping = true;
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+    closeSocket();
+}
+
+void UdpPublisher::closeSocket()
+{
+    if (mSocket != kNetNoSocket) {
+        net_close(mSocket);
+        mSocket = kNetNoSocket;
+    }
+}
+
+void UdpPublisher::threadFn()
+{
+    bool binary = false, osc = false;
+    for (auto& addr : mAddresses) {
+        binary |= addr.format == kBinary;
+        osc |= addr.format == kOsc;
+    }
+
+    uint32_t next = mBuffer->header().status.frame_counter.load(memory_order_acquire);
+    unsigned decimation = max(mOptions.decimation, 1u);
+
+    while (!mStopping) {
+        if (!mBuffer->waitForFrame(next, 0.1)) {
+            continue;
+        }
+
+        // Always send the newest frame; anything we were too slow for is skipped
+        uint32_t latest = mBuffer->header().status.frame_counter.load(memory_order_acquire) - 1;
+        if (copyFrame(latest)) {
+            if (binary) {
+                buildBinary(mPackets[kBinary]);
+            }
+            if (osc) {
+                buildOsc(mPackets[kOsc]);
+            }
+            send();
+        }
+        next = latest + decimation;
+    }
+}
+
+bool UdpPublisher::copyFrame(uint32_t index)
+{
+    FrameCopy& copy = mFrame;
+    unsigned maxPoints = mOptions.max_points;
+
+    TrackingBuffer::ReadResult result = mBuffer->readFrame(index, [&] (const TrackingBuffer::Frame_t &frame) {
+        copy.frame_index = frame.frame_index;
+        copy.timestamp = frame.timestamp;
+        copy.timestamp_ns = frame.timestamp_ns;
+        copy.motionX = frame.motionX;
+        copy.motionY = frame.motionY;
+        copy.num_points = min<uint32_t>(frame.num_points, TrackingBuffer::kMaxTrackingPoints);
+        memcpy(copy.field, frame.motion_field, sizeof copy.field);
+
+        unsigned n = min(copy.num_points, maxPoints);
+        if (n) {
+            memcpy(&copy.id[0], frame.points.id, n * sizeof copy.id[0]);
+            memcpy(&copy.x[0], frame.points.x, n * sizeof copy.x[0]);
+            memcpy(&copy.y[0], frame.points.y, n * sizeof copy.y[0]);
+            memcpy(&copy.dx[0], frame.points.dx, n * sizeof copy.dx[0]);
+            memcpy(&copy.dy[0], frame.points.dy, n * sizeof copy.dy[0]);
+        }
+    });
+
+    if (result != TrackingBuffer::kReadOk) {
+        return false;
+    }
+    mBuffer->readTotalMotion(copy.totalX, copy.totalY);
+    return true;
+}
+
+// Byte order helpers. The binary format is little-endian and OSC is big-endian,
+// whatever this machine is.
+
+static void putLE(vector<uint8_t> &p, uint64_t value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; i++) {
+        p.push_back(uint8_t(value >> (8 * i)));
+    }
+}
+
+static void putBE(vector<uint8_t> &p, uint64_t value, unsigned bytes)
+{
+    for (unsigned i = bytes; i > 0; i--) {
+        p.push_back(uint8_t(value >> (8 * (i - 1))));
+    }
+}
+
+static uint32_t floatBits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof bits);
+    return bits;
+}
+
+static uint64_t doubleBits(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof bits);
+    return bits;
+}
+
+// OSC strings are NUL terminated and padded to a multiple of 4 bytes
+static void putOscString(vector<uint8_t> &p, const char *str)
+{
+    size_t len = strlen(str);
+    p.insert(p.end(), str, str + len);
+    do {
+        p.push_back(0);
+    } while (p.size() & 3);
+}
+
+// Bytes taken by a message's address and type tags, both padded as above
+static size_t oscHeaderSize(const char *address, const char *types)
+{
+    return ((strlen(address) + 4) & ~size_t(3)) + ((strlen(types) + 4) & ~size_t(3));
+}
+
+static void putOscBlobSize(vector<uint8_t> &p, size_t bytes)
+{
+    putBE(p, bytes, 4);
+}
+
+static void padOsc(vector<uint8_t> &p)
+{
+    while (p.size() & 3) {
+        p.push_back(0);
+    }
+}
+
+void UdpPublisher::buildBinary(vector<Packet> &packets)
+{
+    const FrameCopy& f = mFrame;
+    packets.clear();
+
+    auto begin = [&] (PacketType type) -> Packet& {
+        packets.push_back(Packet());
+        Packet& p = packets.back();
+        p.reserve(kMaxPacketSize);
+        putLE(p, kMagic, 4);
+        putLE(p, kVersion, 2);
+        putLE(p, type, 2);
+        putLE(p, mSequence[kBinary]++, 4);
+        putLE(p, f.frame_index, 4);
+        putLE(p, uint64_t(f.timestamp_ns), 8);
+        putLE(p, doubleBits(f.timestamp), 8);
+        return p;
+    };
+
+    Packet& motion = begin(kPacketMotion);
+    putLE(motion, floatBits(f.motionX), 4);
+    putLE(motion, floatBits(f.motionY), 4);
+    putLE(motion, floatBits(f.totalX), 4);
+    putLE(motion, floatBits(f.totalY), 4);
+    putLE(motion, f.num_points, 4);
+
+    const unsigned width = TrackingBuffer::kMotionFieldWidth;
+    const unsigned height = TrackingBuffer::kMotionFieldHeight;
+    const unsigned rowsPerPacket = (kMaxPacketSize - 32 - 8) / (width * 12);
+    for (unsigned row = 0; row < height; row += rowsPerPacket) {
+        unsigned rows = min(rowsPerPacket, height - row);
+        Packet& p = begin(kPacketField);
+        putLE(p, width, 2);
+        putLE(p, height, 2);
+        putLE(p, row, 2);
+        putLE(p, rows, 2);
+        for (unsigned i = row * width; i < (row + rows) * width; i++) {
+            putLE(p, floatBits(f.field[i].dx), 4);
+            putLE(p, floatBits(f.field[i].dy), 4);
+            putLE(p, floatBits(f.field[i].weight), 4);
+        }
+    }
+
+    const unsigned total = min(f.num_points, mOptions.max_points);
+    const unsigned pointsPerPacket = (kMaxPacketSize - 32 - 8) / 24;
+    for (unsigned first = 0; first < total; first += pointsPerPacket) {
+        unsigned n = min(pointsPerPacket, total - first);
+        Packet& p = begin(kPacketPoints);
+        putLE(p, first, 4);
+        putLE(p, total, 4);
+        for (unsigned i = first; i < first + n; i++) {
+            putLE(p, f.id[i], 8);
+            putLE(p, floatBits(f.x[i]), 4);
+            putLE(p, floatBits(f.y[i]), 4);
+            putLE(p, floatBits(f.dx[i]), 4);
+            putLE(p, floatBits(f.dy[i]), 4);
+        }
+    }
+}
+
+void UdpPublisher::buildOsc(vector<Packet> &packets)
+{
+    const FrameCopy& f = mFrame;
+    packets.clear();
+
+    // Every message starts with the sequence number, frame index, and timestamp_ns
+    const size_t commonSize = 16;
+    auto begin = [&] (const char *address, const char *types) -> Packet& {
+        packets.push_back(Packet());
+        Packet& p = packets.back();
+        p.reserve(kMaxPacketSize);
+        putOscString(p, address);
+        putOscString(p, types);
+        putBE(p, mSequence[kOsc]++, 4);
+        putBE(p, f.frame_index, 4);
+        putBE(p, uint64_t(f.timestamp_ns), 8);
+        return p;
+    };
+
+    Packet& motion = begin("/speedyeye/motion", ",iihdffffi");
+    putBE(motion, doubleBits(f.timestamp), 8);
+    putBE(motion, floatBits(f.motionX), 4);
+    putBE(motion, floatBits(f.motionY), 4);
+    putBE(motion, floatBits(f.totalX), 4);
+    putBE(motion, floatBits(f.totalY), 4);
+    putBE(motion, f.num_points, 4);
+
+    // Blobs get whatever room is left after the header, the fixed arguments, and the blob size
+    const char *fieldAddress = "/speedyeye/field";
+    const char *fieldTypes = ",iihiiiib";
+    const size_t fieldOverhead = oscHeaderSize(fieldAddress, fieldTypes) + commonSize + 16 + 4;
+    const unsigned width = TrackingBuffer::kMotionFieldWidth;
+    const unsigned height = TrackingBuffer::kMotionFieldHeight;
+    const unsigned rowsPerPacket = unsigned(kMaxPacketSize - fieldOverhead) / (width * 12);
+    for (unsigned row = 0; row < height; row += rowsPerPacket) {
+        unsigned rows = min(rowsPerPacket, height - row);
+        Packet& p = begin(fieldAddress, fieldTypes);
+        putBE(p, width, 4);
+        putBE(p, height, 4);
+        putBE(p, row, 4);
+        putBE(p, rows, 4);
+        putOscBlobSize(p, rows * width * 12);
+        for (unsigned i = row * width; i < (row + rows) * width; i++) {
+            putBE(p, floatBits(f.field[i].dx), 4);
+            putBE(p, floatBits(f.field[i].dy), 4);
+            putBE(p, floatBits(f.field[i].weight), 4);
+        }
+        padOsc(p);
+    }
+
+    const char *pointsAddress = "/speedyeye/points";
+    const char *pointsTypes = ",iihiib";
+    const size_t pointsOverhead = oscHeaderSize(pointsAddress, pointsTypes) + commonSize + 8 + 4;
+    const unsigned total = min(f.num_points, mOptions.max_points);
+    const unsigned pointsPerPacket = unsigned(kMaxPacketSize - pointsOverhead) / 24;
+    for (unsigned first = 0; first < total; first += pointsPerPacket) {
+        unsigned n = min(pointsPerPacket, total - first);
+        Packet& p = begin(pointsAddress, pointsTypes);
+        putBE(p, first, 4);
+        putBE(p, total, 4);
+        putOscBlobSize(p, n * 24);
+        for (unsigned i = first; i < first + n; i++) {
+            putBE(p, f.id[i], 8);
+            putBE(p, floatBits(f.x[i]), 4);
+            putBE(p, floatBits(f.y[i]), 4);
+            putBE(p, floatBits(f.dx[i]), 4);
+            putBE(p, floatBits(f.dy[i]), 4);
+        }
+        padOsc(p);
+    }
+}
+
+void UdpPublisher::send()
+{
+    // Every packet of each destination's format, to each destination, in as few system
+    // calls as the platform allows
+    struct Message {
+        const Packet *packet;
+        sockaddr_in addr;
+    };
+    Message batch[kSendBatch];
+    unsigned count = 0;
+
+    auto flush = [&] () {
+#ifdef __linux__
+        mmsghdr headers[kSendBatch];
+        iovec iov[kSendBatch];
+        memset(headers, 0, sizeof headers);
+        for (unsigned i = 0; i < count; i++) {
+            iov[i].iov_base = (void*) &(*batch[i].packet)[0];
+            iov[i].iov_len = batch[i].packet->size();
+            headers[i].msg_hdr.msg_name = &batch[i].addr;
+            headers[i].msg_hdr.msg_namelen = sizeof batch[i].addr;
+            headers[i].msg_hdr.msg_iov = &iov[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+        unsigned sent = 0;
+        while (sent < count) {
+            int result = sendmmsg(NET_SOCKET(mSocket), headers + sent, count - sent, 0);
+            if (result <= 0) {
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            sent += result;
+        }
+        mPacketsSent += sent;
+        mPacketsDropped += count - sent;
+#else
+        for (unsigned i = 0; i < count; i++) {
+            const Packet& p = *batch[i].packet;
+            if (sendto(NET_SOCKET(mSocket), (const char*) &p[0], int(p.size()), 0,
+                       (const sockaddr*) &batch[i].addr, sizeof batch[i].addr) == int(p.size())) {
+                mPacketsSent++;
+            } else {
+                mPacketsDropped++;
+            }
+        }
+#endif
+        count = 0;
+    };
+
+    for (auto& addr : mAddresses) {
+        for (auto& packet : mPackets[addr.format]) {
+            Message& m = batch[count++];
+            memset(&m.addr, 0, sizeof m.addr);
+            m.addr.sin_family = AF_INET;
+            m.addr.sin_addr.s_addr = addr.ip;
+            m.addr.sin_port = addr.port;
+            m.packet = &packet;
+            if (count == kSendBatch) {
+                flush();
+            }
+        }
+    }
+    if (count) {
+        flush();
+    }
+}
@@ -0,0 +1,124 @@
+// Publishes motion and tracking points over UDP (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TrackingBuffer.h"
+
+// Follows the tracking buffer on its own thread, so the capture thread never waits on
+// the network, and sends each published frame to any number of unicast or multicast
+// destinations. Every packet starts with a sequence number, shared by all destinations of
+// the same format so receivers can count what they lost, and the frame's index and timestamps.
+//
+// Destinations speak either OSC or a compact little-endian binary format:
+//
+//   Header (32 bytes, every packet)
+//     uint32 magic "SPDU", uint16 version, uint16 type,
+//     uint32 sequence, uint32 frame_index, int64 timestamp_ns, double timestamp
+//
+//   kPacketMotion       float motionX, motionY, totalX, totalY; uint32 num_points
+//   kPacketField        uint16 width, height, first_row, num_rows;
+//                       then num_rows * width cells of float dx, dy, weight
+//   kPacketPoints       uint32 first, total; then points of uint64 id; float x, y, dx, dy
+//
+// The OSC equivalents are /speedyeye/motion ",iihdffffi", /speedyeye/field ",iihiiiib",
+// and /speedyeye/points ",iihiib", with the same fields in the same order and the
+// field and point arrays as big-endian blobs.
+//
+// Frames are never queued: a publisher that falls behind skips ahead to the latest one.
+
+class UdpPublisher {
+public:
+    enum Format {
+        kBinary,
+        kOsc,
+    };
+
+    enum PacketType {
+        kPacketMotion = 1,
+        kPacketField,
+        kPacketPoints,
+    };
+
+    static const uint32_t kMagic = 0x55445053;  // "SPDU"
+    static const uint16_t kVersion = 1;
+
+    // Payload limit that stays inside an Ethernet MTU without fragmenting
+    static const unsigned kMaxPacketSize = 1400;
+
+    struct Destination {
+        std::string host;
+        uint16_t port;
+        Format format;
+    };
+
+    struct Options {
+        std::vector<Destination> destinations;
+        unsigned decimation;    // Send every nth frame
+        unsigned max_points;    // Points to send per frame, zero for none
+        unsigned ttl;           // Hop limit for multicast destinations
+
+        Options();
+    };
+
+    // Parse "host:port" into a destination
+    static bool parseDestination(const std::string &spec, Format format, Destination &dest);
+
+    UdpPublisher();
+    ~UdpPublisher();
+
+    // Resolve destinations and start sending. Returns false with error() set on failure.
+    bool start(TrackingBuffer &buffer, const Options &options);
+    void stop();
+
+    const std::string& error() const { return mError; }
+
+    uint64_t packetsSent() const { return mPacketsSent; }
+    uint64_t packetsDropped() const { return mPacketsDropped; }
+
+private:
+    typedef std::vector<uint8_t> Packet;
+
+    struct Address {
+        uint32_t ip;            // Network byte order
+        uint16_t port;
+        Format format;
+    };
+
+    // The parts of one frame we send, copied out of the ring
+    struct FrameCopy {
+        uint32_t frame_index;
+        double timestamp;
+        int64_t timestamp_ns;
+        float motionX, motionY;
+        float totalX, totalY;
+        uint32_t num_points;
+        TrackingBuffer::MotionCell_t field[TrackingBuffer::kMotionFieldWidth * TrackingBuffer::kMotionFieldHeight];
+        std::vector<uint64_t> id;
+        std::vector<float> x, y, dx, dy;
+    };
+
+    Options mOptions;
+    TrackingBuffer *mBuffer;
+    std::string mError;
+    std::vector<Address> mAddresses;
+    intptr_t mSocket;
+    std::thread mThread;
+    std::atomic<bool> mStopping;
+    std::atomic<uint64_t> mPacketsSent;
+    std::atomic<uint64_t> mPacketsDropped;
+    uint32_t mSequence[2];              // Next packet sequence number, by Format
+    FrameCopy mFrame;
+    std::vector<Packet> mPackets[2];    // This frame's packets, by Format
+
+    void threadFn();
+    bool copyFrame(uint32_t index);
+    void buildBinary(std::vector<Packet> &packets);
+    void buildOsc(std::vector<Packet> &packets);
+    void send();
+    void closeSocket();
+};
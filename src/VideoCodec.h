@@ -0,0 +1,423 @@
+// Lossless video codec for streaming the capture ring (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "yuv422.h"
+
+// Header-only, and independent of the tracking buffer, so receivers can use it too.
+//
+// A stream is a StreamHeader_t, then for each frame a FrameHeader_t followed by
+// payload_size bytes of payload. Everything is little-endian. The receiver sends back
+// the uint32 frame_index of each frame once it has decoded it; the sender uses these to
+// keep only a few frames in flight, skipping frames instead of building up latency.
+//
+// Each payload is one LZ4 block (the plain block format, with no LZ4 frame around it)
+// that decompresses to the frame's residual planes: Y at full resolution, then for
+// kFormatYuv422 the U and V planes at half width. A keyframe's residuals are each pixel
+// minus the one to its left, and every other frame's are each pixel minus the same pixel
+// of the previous frame on the stream, all mod 256. A still camera gives residuals that
+// are almost all zero, which LZ4 shrinks to almost nothing.
+//
+// Luminance is exactly what the camera sent. The chroma is recovered from the ring's RGB
+// by inverting yuv422_to_rgbl(), which is exact except where a color channel saturated,
+// so kFormatYuv422 is lossless for all but the brightest and most saturated pixels.
+
+class VideoCodec {
+public:
+    enum Format {
+        kFormatLuma = 0,                // Y plane only
+        kFormatYuv422 = 1,              // Y, then U and V at half width
+    };
+
+    enum FrameFlags {
+        kKeyframe = 1 << 0,             // Predicted within the frame; resets the receiver
+    };
+
+    static const uint32_t kMagic = 0x56445053;  // "SPDV"
+    static const uint16_t kVersion = 1;
+
+    struct StreamHeader_t {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t format;                // Format
+        uint16_t width, height;
+        uint32_t reserved;
+    };
+
+    struct FrameHeader_t {
+        uint32_t payload_size;          // Bytes of LZ4 block that follow
+        uint32_t frame_index;
+        int64_t timestamp_ns;           // Monotonic clock at capture
+        double timestamp;               // Seconds since the producer started
+        uint16_t flags;                 // FrameFlags
+        uint16_t reserved;
+        uint32_t skipped;               // Frames since the previous one on this stream that weren't sent
+    };
+
+    struct Plane {
+        size_t offset;
+        unsigned width, height;
+    };
+
+    // Planes for a format, returning how many there are
+    static unsigned planes(Format format, unsigned width, unsigned height, Plane *out) {
+        out[0].offset = 0;
+        out[0].width = width;
+        out[0].height = height;
+        if (format == kFormatLuma) {
+            return 1;
+        }
+        for (unsigned i = 1; i < 3; i++) {
+            out[i].offset = size_t(width) * height + size_t(width / 2) * height * (i - 1);
+            out[i].width = width / 2;
+            out[i].height = height;
+        }
+        return 3;
+    }
+
+    static size_t rawSize(Format format, unsigned width, unsigned height) {
+        return size_t(width) * height * (format == kFormatLuma ? 1 : 2);
+    }
+
+    static size_t maxCompressedSize(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    // Greedy LZ4 block compressor. Returns the compressed size; dst needs room for
+    // maxCompressedSize(size) bytes.
+    static size_t compress(const uint8_t *src, size_t size, uint8_t *dst) {
+        static const unsigned kHashBits = 14;
+        static const size_t kMinMatch = 4;
+        static const size_t kLastLiterals = 5;      // The format requires these at the end
+        static const size_t kMatchStartLimit = 12;  // No match may start closer to the end
+
+        std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+        uint8_t *op = dst;
+        size_t anchor = 0;
+        size_t ip = 0;
+
+        if (size > kMatchStartLimit) {
+            size_t matchEnd = size - kLastLiterals;
+            while (ip + kMatchStartLimit <= size) {
+                uint32_t sequence = read32(src + ip);
+                uint32_t hash = (sequence * 2654435761u) >> (32 - kHashBits);
+                size_t ref = table[hash];
+                table[hash] = uint32_t(ip);
+
+                if (ref >= ip || ip - ref > 0xFFFF || read32(src + ref) != sequence) {
+                    // Skip faster through data that isn't matching
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+
+                size_t length = kMinMatch;
+                while (ip + length < matchEnd && src[ref + length] == src[ip + length]) {
+                    length++;
+                }
+
+                uint8_t *token = op;
+                op = putLiterals(op, src + anchor, ip - anchor);
+                *op++ = uint8_t(ip - ref);
+                *op++ = uint8_t((ip - ref) >> 8);
+                *token |= uint8_t(std::min<size_t>(length - kMinMatch, 15));
+                putLength(op, length - kMinMatch);
+                ip += length;
+                anchor = ip;
+            }
+        }
+
+        op = putLiterals(op, src + anchor, size - anchor);
+        return size_t(op - dst);
+    }
+
+    // Decompress an LZ4 block that must expand to exactly size bytes. Returns false if
+    // the block is malformed, without writing outside dst.
+    static bool decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t size) {
+        const uint8_t *ip = src;
+        const uint8_t *end = src + srcSize;
+        uint8_t *op = dst;
+        uint8_t *opEnd = dst + size;
+
+        while (ip < end) {
+            unsigned token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !getLength(ip, end, literals)) {
+                return false;
+            }
+            if (size_t(end - ip) < literals || size_t(opEnd - op) < literals) {
+                return false;
+            }
+            memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            if (ip == end) {
+                break;  // The last sequence has no match
+            }
+
+            if (end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > size_t(op - dst)) {
+                return false;
+            }
+
+            size_t length = token & 15;
+            if (length == 15 && !getLength(ip, end, length)) {
+                return false;
+            }
+            length += 4;
+            if (size_t(opEnd - op) < length) {
+                return false;
+            }
+
+            const uint8_t *match = op - offset;
+            if (offset >= length) {
+                memcpy(op, match, length);
+                op += length;
+            } else {
+                // Overlapping copies repeat the last offset bytes
+                while (length--) {
+                    *op++ = *match++;
+                }
+            }
+        }
+        return op == opEnd;
+    }
+
+private:
+    static uint32_t read32(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+    }
+
+    // Extra bytes for a length that didn't fit in its 4 bits of the token
+    static void putLength(uint8_t *&op, size_t length) {
+        if (length >= 15) {
+            length -= 15;
+            while (length >= 255) {
+                *op++ = 255;
+                length -= 255;
+            }
+            *op++ = uint8_t(length);
+        }
+    }
+
+    static bool getLength(const uint8_t *&ip, const uint8_t *end, size_t &length) {
+        unsigned byte;
+        do {
+            if (ip == end) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // Start a sequence: its token, with the match length left zero, then the literals
+    static uint8_t *putLiterals(uint8_t *op, const uint8_t *literals, size_t count) {
+        *op++ = uint8_t(std::min<size_t>(count, 15) << 4);
+        putLength(op, count);
+        memcpy(op, literals, count);
+        return op + count;
+    }
+};
+
+// Turns frames from the ring into a stream's frame messages. One per stream, since each
+// frame is predicted from the last one sent on the same stream.
+class VideoEncoder {
+public:
+    VideoEncoder(VideoCodec::Format format, unsigned width, unsigned height)
+        : mFormat(format), mWidth(width), mHeight(height), mHaveReference(false),
+          mPlanes(VideoCodec::rawSize(format, width, height)),
+          mReference(mPlanes.size()),
+          mResidual(mPlanes.size())
+    {}
+
+    VideoCodec::StreamHeader_t streamHeader() const {
+        VideoCodec::StreamHeader_t header = {};
+        header.magic = VideoCodec::kMagic;
+        header.version = VideoCodec::kVersion;
+        header.format = uint16_t(mFormat);
+        header.width = uint16_t(mWidth);
+        header.height = uint16_t(mHeight);
+        return header;
+    }
+
+    // Fill the planes from the ring's 32-bit pixels: blue, green, red, luminance
+    void loadPixels(const uint32_t *pixels) {
+        const uint8_t *src = reinterpret_cast<const uint8_t*>(pixels);
+        uint8_t *y = &mPlanes[0];
+        size_t count = size_t(mWidth) * mHeight;
+
+        if (mFormat == VideoCodec::kFormatLuma) {
+            for (size_t i = 0; i < count; i++) {
+                y[i] = src[i * 4 + 3];
+            }
+            return;
+        }
+
+        uint8_t *u = y + count;
+        uint8_t *v = u + count / 2;
+        for (size_t i = 0; i < count; i += 2, src += 8) {
+            y[i] = src[3];
+            y[i + 1] = src[7];
+            u[i / 2] = chroma(src[0], src[3], src[4], src[7], ITUR_BT_601_CUB);
+            v[i / 2] = chroma(src[2], src[3], src[6], src[7], ITUR_BT_601_CVR);
+        }
+    }
+
+    // Encode the loaded planes as the next frame on the stream, replacing out with the
+    // frame header and payload
+    void encode(std::vector<uint8_t> &out, uint32_t frameIndex, int64_t timestampNs, double timestamp,
+                uint32_t skipped, bool keyframe = false) {
+        VideoCodec::Plane planes[3];
+        unsigned numPlanes = VideoCodec::planes(mFormat, mWidth, mHeight, planes);
+        keyframe = keyframe || !mHaveReference;
+
+        if (keyframe) {
+            for (unsigned p = 0; p < numPlanes; p++) {
+                for (unsigned row = 0; row < planes[p].height; row++) {
+                    size_t i = planes[p].offset + size_t(row) * planes[p].width;
+                    mResidual[i] = mPlanes[i];
+                    for (unsigned x = 1; x < planes[p].width; x++) {
+                        mResidual[i + x] = uint8_t(mPlanes[i + x] - mPlanes[i + x - 1]);
+                    }
+                }
+            }
+        } else {
+            for (size_t i = 0; i < mPlanes.size(); i++) {
+                mResidual[i] = uint8_t(mPlanes[i] - mReference[i]);
+            }
+        }
+
+        VideoCodec::FrameHeader_t header = {};
+        out.resize(sizeof header + VideoCodec::maxCompressedSize(mResidual.size()));
+        header.payload_size = uint32_t(VideoCodec::compress(&mResidual[0], mResidual.size(), &out[sizeof header]));
+        header.frame_index = frameIndex;
+        header.timestamp_ns = timestampNs;
+        header.timestamp = timestamp;
+        header.flags = keyframe ? VideoCodec::kKeyframe : 0;
+        header.skipped = skipped;
+        memcpy(&out[0], &header, sizeof header);
+        out.resize(sizeof header + header.payload_size);
+
+        mReference.swap(mPlanes);
+        mHaveReference = true;
+    }
+
+private:
+    VideoCodec::Format mFormat;
+    unsigned mWidth, mHeight;
+    bool mHaveReference;
+    std::vector<uint8_t> mPlanes;       // Frame being encoded
+    std::vector<uint8_t> mReference;    // Last frame sent, as the receiver has it
+    std::vector<uint8_t> mResidual;
+
+    // Invert the blue (U) or red (V) term of yuv422_to_rgbl() for one pixel pair. Each
+    // step of the chroma moves the color channel by more than one, so any pixel that
+    // didn't clip gives back the exact value.
+    static uint8_t chroma(uint8_t c0, uint8_t y0, uint8_t c1, uint8_t y1, int coefficient) {
+        int sum = 0, count = 0;
+        if (c0 > 0 && c0 < 255) {
+            sum += chromaFromPixel(c0, y0, coefficient);
+            count++;
+        }
+        if (c1 > 0 && c1 < 255) {
+            sum += chromaFromPixel(c1, y1, coefficient);
+            count++;
+        }
+        if (!count) {
+            // Both clipped; the best we can do is a chroma that clips the same way
+            sum = chromaFromPixel(c0, y0, coefficient);
+            count = 1;
+        }
+        int c = (sum + (sum >= 0 ? count / 2 : -(count / 2))) / count;
+        return uint8_t(std::min(127, std::max(-128, c)) + 128);
+    }
+
+    static int chromaFromPixel(uint8_t c, uint8_t y, int coefficient) {
+        int64_t scaledY = int64_t(std::max(0, int(y) - 16)) * ITUR_BT_601_CY;
+        int64_t target = (int64_t(c) << ITUR_BT_601_SHIFT) - scaledY;
+        // Round to nearest, symmetric around zero
+        return int(target >= 0 ? (target + coefficient / 2) / coefficient
+                               : -((-target + coefficient / 2) / coefficient));
+    }
+};
+
+// Reconstructs frames from a stream. Feed it every frame message in order.
+class VideoDecoder {
+public:
+    VideoDecoder(VideoCodec::Format format, unsigned width, unsigned height)
+        : mFormat(format), mWidth(width), mHeight(height), mHaveReference(false),
+          mPlanes(VideoCodec::rawSize(format, width, height)),
+          mResidual(mPlanes.size())
+    {}
+
+    // Decode one frame's payload. Returns false if it's corrupt, or if it needs a
+    // previous frame we don't have; the decoder then waits for a keyframe.
+    bool decode(const VideoCodec::FrameHeader_t &header, const uint8_t *payload) {
+        bool keyframe = (header.flags & VideoCodec::kKeyframe) != 0;
+        if (!(keyframe || mHaveReference)
+            || !VideoCodec::decompress(payload, header.payload_size, &mResidual[0], mResidual.size())) {
+            mHaveReference = false;
+            return false;
+        }
+
+        if (keyframe) {
+            VideoCodec::Plane planes[3];
+            unsigned numPlanes = VideoCodec::planes(mFormat, mWidth, mHeight, planes);
+            for (unsigned p = 0; p < numPlanes; p++) {
+                for (unsigned row = 0; row < planes[p].height; row++) {
+                    size_t i = planes[p].offset + size_t(row) * planes[p].width;
+                    mPlanes[i] = mResidual[i];
+                    for (unsigned x = 1; x < planes[p].width; x++) {
+                        mPlanes[i + x] = uint8_t(mPlanes[i + x - 1] + mResidual[i + x]);
+                    }
+                }
+            }
+        } else {
+            for (size_t i = 0; i < mPlanes.size(); i++) {
+                mPlanes[i] = uint8_t(mPlanes[i] + mResidual[i]);
+            }
+        }
+
+        mHaveReference = true;
+        return true;
+    }
+
+    // The last frame decoded, as planes (see VideoCodec)
+    const uint8_t *planes() const { return &mPlanes[0]; }
+    size_t size() const { return mPlanes.size(); }
+
+    // The last frame as packed YUYV, two bytes per pixel, for kFormatYuv422 streams.
+    // This is what the camera sends, and what yuv422_to_rgbl() takes.
+    void toYuyv(uint8_t *out) const {
+        size_t count = size_t(mWidth) * mHeight;
+        const uint8_t *y = &mPlanes[0];
+        const uint8_t *u = y + count;
+        const uint8_t *v = u + count / 2;
+        for (size_t i = 0; i < count; i += 2, out += 4) {
+            out[0] = y[i];
+            out[1] = u[i / 2];
+            out[2] = y[i + 1];
+            out[3] = v[i / 2];
+        }
+    }
+
+private:
+    VideoCodec::Format mFormat;
+    unsigned mWidth, mHeight;
+    bool mHaveReference;
+    std::vector<uint8_t> mPlanes;
+    std::vector<uint8_t> mResidual;
+};
@@ -0,0 +1,230 @@
+// Streams the capture ring over TCP (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#include "net.h"
+#include <string.h>
+#include "VideoServer.h"
+
+using namespace std;
+
+VideoServer::Options::Options()
+    : port(0),
+      format(VideoCodec::kFormatYuv422),
+      decimation(1),
+      max_clients(4),
+      max_in_flight(2)
+{}
+
+VideoServer::VideoServer()
+    : mBuffer(0),
+      mListenSocket(kNetNoSocket),
+      mStopping(false),
+      mNumClients(0),
+      mFramesSent(0),
+      mFramesSkipped(0),
+      mBytesSent(0)
+{}
+
+VideoServer::~VideoServer()
+{
+    stop();
+}
+
+bool VideoServer::start(TrackingBuffer &buffer, const Options &options)
+{
+    stop();
+    mBuffer = &buffer;
+    mOptions = options;
+
+    if (!net_startup()) {
+        mError = "Can't start Winsock";
+        return false;
+    }
+
+    mListenSocket = intptr_t(socket(AF_INET, SOCK_STREAM, 0));
+    if (mListenSocket == kNetNoSocket) {
+        mError = "Can't create a TCP socket";
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(NET_SOCKET(mListenSocket), SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof reuse);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options.port);
+
+    if (::bind(NET_SOCKET(mListenSocket), (const sockaddr*) &addr, sizeof addr)
+        || listen(NET_SOCKET(mListenSocket), 4)) {
+        mError = "Can't listen on port " + to_string(options.port);
+        net_close(mListenSocket);
+        mListenSocket = kNetNoSocket;
+        return false;
+    }
+
+    mStopping = false;
+    mThread = thread(&VideoServer::listenThreadFn, this);
+    return true;
+}
+
+void VideoServer::stop()
+{
+    mStopping = true;
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+    if (mListenSocket != kNetNoSocket) {
+        net_close(mListenSocket);
+        mListenSocket = kNetNoSocket;
+    }
+}
+
+void VideoServer::listenThreadFn()
+{
+    while (!mStopping) {
+        reapClients(false);
+
+        if (!net_wait_readable(mListenSocket, 100)) {
+            continue;
+        }
+        intptr_t s = intptr_t(accept(NET_SOCKET(mListenSocket), 0, 0));
+        if (s == kNetNoSocket) {
+            continue;
+        }
+        if (mClients.size() >= mOptions.max_clients) {
+            net_close(s);
+            continue;
+        }
+
+        int noDelay = 1;
+        setsockopt(NET_SOCKET(s), IPPROTO_TCP, TCP_NODELAY, (const char*) &noDelay, sizeof noDelay);
+#ifdef SO_NOSIGPIPE
+        int noSigPipe = 1;
+        setsockopt(NET_SOCKET(s), SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof noSigPipe);
+#endif
+        net_set_send_timeout(s, 100);
+
+        unique_ptr<Client> client(new Client);
+        client->socket = s;
+        client->done = false;
+        client->thread = thread(&VideoServer::clientThreadFn, this, client.get());
+        mClients.push_back(move(client));
+        mNumClients = unsigned(mClients.size());
+    }
+
+    reapClients(true);
+}
+
+void VideoServer::reapClients(bool all)
+{
+    for (auto i = mClients.begin(); i != mClients.end();) {
+        Client& client = **i;
+        if (all || client.done) {
+            client.thread.join();
+            i = mClients.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    mNumClients = unsigned(mClients.size());
+}
+
+void VideoServer::clientThreadFn(Client *client)
+{
+    VideoEncoder encoder(mOptions.format, TrackingBuffer::kWidth, TrackingBuffer::kHeight);
+    VideoCodec::StreamHeader_t streamHeader = encoder.streamHeader();
+    vector<uint8_t> message;
+    unsigned decimation = max(mOptions.decimation, 1u);
+    unsigned maxInFlight = max(mOptions.max_in_flight, 1u);
+    unsigned inFlight = 0;
+    unsigned ackBytes = 0;
+
+    bool ok = sendAll(client->socket, reinterpret_cast<const uint8_t*>(&streamHeader), sizeof streamHeader);
+
+    // Start with the latest frame, so a viewer of a paused camera still sees something
+    uint32_t next = mBuffer->header().status.frame_counter.load(memory_order_acquire);
+    if (next) {
+        next--;
+    }
+    uint32_t lastSent = 0;
+    bool sentAny = false;
+
+    while (ok && !mStopping) {
+        if (!readAcks(client->socket, inFlight, ackBytes)) {
+            break;
+        }
+        if (inFlight >= maxInFlight) {
+            // The viewer is behind; let frames go by until it catches up
+            net_wait_readable(client->socket, 100);
+            continue;
+        }
+        if (!mBuffer->waitForFrame(next, 0.1)) {
+            continue;
+        }
+
+        // Whatever arrived while the last frame was going out is skipped
+        uint32_t latest = mBuffer->header().status.frame_counter.load(memory_order_acquire) - 1;
+        next = latest + 1;
+
+        int64_t timestampNs = 0;
+        double timestamp = 0;
+        if (mBuffer->readPixels(latest, [&] (const TrackingBuffer::Pixels_t &p) {
+                encoder.loadPixels(p.pixels);
+            }) != TrackingBuffer::kReadOk
+            || mBuffer->readFrame(latest, [&] (const TrackingBuffer::Frame_t &f) {
+                timestampNs = f.timestamp_ns;
+                timestamp = f.timestamp;
+            }) != TrackingBuffer::kReadOk) {
+            continue;
+        }
+
+        uint32_t skipped = sentAny ? latest - lastSent - 1 : 0;
+        encoder.encode(message, latest, timestampNs, timestamp, skipped);
+        ok = sendAll(client->socket, &message[0], message.size());
+
+        inFlight++;
+        mFramesSent++;
+        mFramesSkipped += skipped;
+        lastSent = latest;
+        sentAny = true;
+        next = latest + decimation;
+    }
+
+    net_close(client->socket);
+    client->done = true;
+}
+
+// Count acknowledgements without blocking. Returns false once the viewer hangs up.
+bool VideoServer::readAcks(intptr_t socket, unsigned &inFlight, unsigned &ackBytes)
+{
+    uint8_t buffer[256];
+    while (net_wait_readable(socket, 0)) {
+        int result = int(recv(NET_SOCKET(socket), (char*) buffer, sizeof buffer, 0));
+        if (result <= 0) {
+            return false;
+        }
+        ackBytes += result;
+        inFlight -= min(inFlight, ackBytes / 4);
+        ackBytes %= 4;
+    }
+    return true;
+}
+
+bool VideoServer::sendAll(intptr_t socket, const uint8_t *data, size_t size)
+{
+    while (size) {
+        int result = int(send(NET_SOCKET(socket), (const char*) data, int(min<size_t>(size, 1 << 30)), MSG_NOSIGNAL));
+        if (result > 0) {
+            data += result;
+            size -= result;
+            mBytesSent += result;
+        } else if (result < 0 && net_would_block() && !mStopping) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+// Streams the capture ring over TCP (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include "TrackingBuffer.h"
+#include "VideoCodec.h"
+
+// Live video for remote monitoring. Each connection gets the stream described in
+// VideoCodec.h, encoded on its own thread from the tracking buffer, so neither the
+// capture thread nor other viewers ever wait on a slow network.
+//
+// Frames are never queued. Viewers acknowledge each frame they decode (see VideoCodec.h),
+// and once max_in_flight frames are unacknowledged, newer ones are skipped; the next
+// frame sent is always the latest, with the number skipped in its header. A viewer on a
+// slow link or a slow machine gets fewer frames, not older ones.
+
+class VideoServer {
+public:
+    static const uint16_t kDefaultPort = 9100;
+
+    struct Options {
+        uint16_t port;              // Zero when there's no server wanted
+        VideoCodec::Format format;
+        unsigned decimation;        // Send at most every nth frame
+        unsigned max_clients;
+        unsigned max_in_flight;     // Frames sent but not yet acknowledged, per viewer
+
+        Options();
+    };
+
+    VideoServer();
+    ~VideoServer();
+
+    // Listen for viewers. Returns false with error() set on failure.
+    bool start(TrackingBuffer &buffer, const Options &options);
+    void stop();
+
+    const std::string& error() const { return mError; }
+
+    unsigned numClients() const { return mNumClients; }
+    uint64_t framesSent() const { return mFramesSent; }
+    uint64_t framesSkipped() const { return mFramesSkipped; }
+    uint64_t bytesSent() const { return mBytesSent; }
+
+private:
+    struct Client {
+        intptr_t socket;
+        std::thread thread;
+        std::atomic<bool> done;
+    };
+
+    Options mOptions;
+    TrackingBuffer *mBuffer;
+    std::string mError;
+    intptr_t mListenSocket;
+    std::thread mThread;
+    std::list<std::unique_ptr<Client>> mClients;   // Only touched by the listening thread
+    std::atomic<bool> mStopping;
+    std::atomic<unsigned> mNumClients;
+    std::atomic<uint64_t> mFramesSent;
+    std::atomic<uint64_t> mFramesSkipped;
+    std::atomic<uint64_t> mBytesSent;
+
+    void listenThreadFn();
+    void clientThreadFn(Client *client);
+    bool sendAll(intptr_t socket, const uint8_t *data, size_t size);
+    bool readAcks(intptr_t socket, unsigned &inFlight, unsigned &ackBytes);
+    void reapClients(bool all);
+};
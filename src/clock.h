@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+// System clocks in 64-bit nanoseconds, for timestamps that mean something to other processes.
+//
+// The monotonic clock is CLOCK_MONOTONIC on Linux, mach_absolute_time() on Mac OS, and
+// QueryPerformanceCounter() on Windows. It never jumps, but its zero is arbitrary (usually
+// boot). The realtime clock counts from the Unix epoch and can be stepped by NTP or the user.
+
+static inline int64_t clock_monotonic_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    // Split to avoid overflowing the multiplication
+    int64_t seconds = counter.QuadPart / frequency.QuadPart;
+    int64_t remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000000LL + remainder * 1000000000LL / frequency.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom) {
+        mach_timebase_info(&timebase);
+    }
+    return int64_t(mach_absolute_time() * timebase.numer / timebase.denom);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static inline int64_t clock_realtime_ns()
+{
+#ifdef _WIN32
+    // FILETIME counts 100 ns intervals since 1601
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    int64_t ticks = (int64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000LL) * 100;
+#elif defined(__APPLE__)
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return int64_t(tv.tv_sec) * 1000000000LL + int64_t(tv.tv_usec) * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+// Halve a 32-bit-per-pixel image in each dimension with a 2x2 box filter.
+// All four 8-bit channels are averaged independently, with rounding.
+// Width and height are those of the source image, and must be even.
+//
+// Like yuv422_to_rgbl, the kernel is specialized on source size, with zero meaning the
+// size is only known at runtime.
+
+template <int kWidth, int kHeight>
+static void bgrl_downsample_2x_sized(const uint32_t *src, uint32_t *dst, int width, int height)
+{
+    if (kWidth) width = kWidth;
+    if (kHeight) height = kHeight;
+
+    const int dst_width = width / 2;
+    const int dst_height = height / 2;
+    int j, i;
+
+    for (j = 0; j < dst_height; j++)
+    {
+        const uint32_t* row0 = src + width * (2 * j);
+        const uint32_t* row1 = row0 + width;
+        uint32_t* out = dst + dst_width * j;
+
+        for (i = 0; i < dst_width; i++, row0 += 2, row1 += 2)
+        {
+            // Split into even and odd channels, leaving 8 bits of headroom per channel
+            uint32_t a = row0[0], b = row0[1], c = row1[0], d = row1[1];
+
+            uint32_t lo = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) + (d & 0x00ff00ff);
+            uint32_t hi = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+                          ((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff);
+
+            lo = ((lo + 0x00020002) >> 2) & 0x00ff00ff;
+            hi = ((hi + 0x00020002) >> 2) & 0x00ff00ff;
+
+            out[i] = lo | (hi << 8);
+        }
+    }
+}
+
+// Specializations for each level of the QVGA preview chain
+
+static inline void bgrl_downsample_2x(const uint32_t *src, uint32_t *dst, const int width, const int height)
+{
+    if (width == 320 && height == 240) {
+        bgrl_downsample_2x_sized<320, 240>(src, dst, width, height);
+    } else if (width == 160 && height == 120) {
+        bgrl_downsample_2x_sized<160, 120>(src, dst, width, height);
+    } else {
+        bgrl_downsample_2x_sized<0, 0>(src, dst, width, height);
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+// Sleep until a 32-bit word in shared memory changes, and wake those sleepers.
+// On Linux these are process-shared futexes. Other platforms have no cross-process
+// equivalent we can rely on, so waiters poll with short sleeps instead.
+
+static const double kFutexPollInterval = 100e-6;
+
+// Returns when *word may no longer equal expected, or after roughly timeout seconds.
+// Spurious returns are possible; callers should re-check their condition.
+
+static inline void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, double timeout)
+{
+    if (timeout <= 0) {
+        return;
+    }
+
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = time_t(timeout);
+    ts.tv_nsec = long((timeout - ts.tv_sec) * 1e9);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, NULL, 0);
+#else
+    if (word->load(std::memory_order_acquire) == expected) {
+        double interval = timeout < kFutexPollInterval ? timeout : kFutexPollInterval;
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+    }
+#endif
+}
+
+static inline void futex_wake_all(std::atomic<uint32_t> *word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+    (void) word;
+#endif
+}
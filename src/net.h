@@ -0,0 +1,107 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// Just enough portability for the BSD socket API. Sockets are kept in an intptr_t, so
+// headers that store one don't need any of the platform's networking headers; use
+// NET_SOCKET() to hand one back to the system.
+
+#ifdef _WIN32
+#define NET_SOCKET(s) SOCKET(s)
+static const intptr_t kNetNoSocket = intptr_t(INVALID_SOCKET);
+#else
+#define NET_SOCKET(s) int(s)
+static const intptr_t kNetNoSocket = -1;
+#endif
+
+// Mac OS has SO_NOSIGPIPE instead, and Windows has no SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Winsock needs starting before anything else. Returns false if that failed.
+static inline bool net_startup()
+{
+#ifdef _WIN32
+    static bool started = false;
+    if (!started) {
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+            return false;
+        }
+        started = true;
+    }
+#endif
+    return true;
+}
+
+static inline void net_close(intptr_t s)
+{
+#ifdef _WIN32
+    closesocket(NET_SOCKET(s));
+#else
+    close(NET_SOCKET(s));
+#endif
+}
+
+static inline void net_set_nonblocking(intptr_t s)
+{
+#ifdef _WIN32
+    u_long nonblocking = 1;
+    ioctlsocket(NET_SOCKET(s), FIONBIO, &nonblocking);
+#else
+    fcntl(NET_SOCKET(s), F_SETFL, fcntl(NET_SOCKET(s), F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+// Give up on a blocking send() after this long, so the caller can check whether it's
+// still wanted. A send that times out reports net_would_block().
+static inline void net_set_send_timeout(intptr_t s, unsigned milliseconds)
+{
+#ifdef _WIN32
+    DWORD timeout = milliseconds;
+#else
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+    setsockopt(NET_SOCKET(s), SOL_SOCKET, SO_SNDTIMEO, (const char*) &timeout, sizeof timeout);
+}
+
+// Did the last call fail only because it would have had to wait?
+static inline bool net_would_block()
+{
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Wait up to this long for a socket to become readable
+static inline bool net_wait_readable(intptr_t s, unsigned milliseconds)
+{
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(NET_SOCKET(s), &readable);
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    return select(int(s) + 1, &readable, 0, 0, &timeout) > 0;
+}
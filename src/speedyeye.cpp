@@ -0,0 +1,420 @@
+// C interface for SpeedyEye tracking buffer clients (c) 2015 Micah Elizabeth Scott
+// MIT license
+
+#include <string.h>
+#include "speedyeye.h"
+#include "TrackingClient.h"
+#include "VideoCodec.h"
+
+struct speedyeye_client {
+    TrackingClient client;
+};
+
+// The C and C++ result codes are interchangeable
+static_assert(SPEEDYEYE_READ_OK == int(TrackingBuffer::kReadOk)
+    && SPEEDYEYE_READ_NOT_READY == int(TrackingBuffer::kReadNotReady)
+    && SPEEDYEYE_READ_OVERRUN == int(TrackingBuffer::kReadOverrun)
+    && SPEEDYEYE_READ_BUSY == int(TrackingBuffer::kReadBusy), "ReadResult mismatch");
+
+static_assert(sizeof(speedyeye_history_point) == sizeof(TrackingBuffer::HistoryPoint_t)
+    && offsetof(speedyeye_history_point, x) == offsetof(TrackingBuffer::HistoryPoint_t, x),
+    "HistoryPoint_t mismatch");
+
+static_assert(sizeof(((speedyeye_client_stats*) 0)->name) == TrackingBuffer::kClientNameSize,
+    "Client name size mismatch");
+
+static_assert(SPEEDYEYE_COMMAND_SET_CONTROL == int(TrackingBuffer::kCommandSetControl)
+    && SPEEDYEYE_COMMAND_RESET_MOTION == int(TrackingBuffer::kCommandResetMotion)
+    && SPEEDYEYE_COMMAND_RESET_POINTS == int(TrackingBuffer::kCommandResetPoints)
+    && SPEEDYEYE_COMMAND_SNAPSHOT == int(TrackingBuffer::kCommandSnapshot), "CommandType mismatch");
+
+static_assert(SPEEDYEYE_CONTROL_MIN_POINT_QUALITY == int(TrackingBuffer::kControlMinPointQuality)
+    && SPEEDYEYE_CONTROL_FLIP_V == int(TrackingBuffer::kControlFlipV)
+    && SPEEDYEYE_CONTROL_FLIP_V + 1 == int(TrackingBuffer::kNumControls), "ControlId mismatch");
+
+static_assert(SPEEDYEYE_MAX_REGIONS == TrackingBuffer::kMaxRegions
+    && SPEEDYEYE_REGION_CELL_SIZE == TrackingBuffer::kPointIndexCellSize
+    && SPEEDYEYE_REGION_MASK_WIDTH == TrackingBuffer::kPointIndexWidth
+    && SPEEDYEYE_REGION_MASK_WORDS == TrackingBuffer::kRegionMaskWords, "Region size mismatch");
+
+static_assert(sizeof(speedyeye_region_motion) == sizeof(TrackingBuffer::RegionMotion_t)
+    && offsetof(speedyeye_region_motion, total_x) == offsetof(TrackingBuffer::RegionMotion_t, totalX),
+    "RegionMotion_t mismatch");
+
+static bool validRegion(int index)
+{
+    return index >= 0 && index < int(TrackingBuffer::kMaxRegions);
+}
+
+static_assert(SPEEDYEYE_MAX_RULES == TrackingBuffer::kMaxRules
+    && SPEEDYEYE_EVENT_RING_SIZE == TrackingBuffer::kEventRingSize, "Rule size mismatch");
+
+static_assert(SPEEDYEYE_EVENT_START == int(TrackingBuffer::kEventStart)
+    && SPEEDYEYE_EVENT_STOP == int(TrackingBuffer::kEventStop)
+    && SPEEDYEYE_EVENT_DIRECTION == int(TrackingBuffer::kEventDirection), "EventType mismatch");
+
+static_assert(sizeof(speedyeye_rule) == sizeof(TrackingBuffer::RuleConfig_t)
+    && offsetof(speedyeye_rule, debounce) == offsetof(TrackingBuffer::RuleConfig_t, debounce),
+    "RuleConfig_t mismatch");
+
+static bool validRule(int index)
+{
+    return index >= 0 && index < int(TrackingBuffer::kMaxRules);
+}
+
+struct speedyeye_video_decoder {
+    VideoDecoder decoder;
+    int format;
+
+    speedyeye_video_decoder(int format, uint32_t width, uint32_t height)
+        : decoder(VideoCodec::Format(format), width, height), format(format) {}
+};
+
+static_assert(SPEEDYEYE_VIDEO_LUMA == int(VideoCodec::kFormatLuma)
+    && SPEEDYEYE_VIDEO_YUV422 == int(VideoCodec::kFormatYuv422), "Video format mismatch");
+
+static_assert(sizeof(VideoCodec::FrameHeader_t) == 32, "Video frame header size");
+
+static speedyeye_client *finishOpen(speedyeye_client *handle, bool ok, char *error, size_t error_size)
+{
+    if (ok) {
+        return handle;
+    }
+    if (error && error_size) {
+        strncpy(error, handle->client.error().c_str(), error_size - 1);
+        error[error_size - 1] = '\0';
+    }
+    delete handle;
+    return 0;
+}
+
+speedyeye_client *speedyeye_open(const char *name, char *error, size_t error_size)
+{
+    speedyeye_client *handle = new speedyeye_client;
+    bool ok = handle->client.open(name ? name : TrackingClient::defaultName());
+    return finishOpen(handle, ok, error, error_size);
+}
+
+speedyeye_client *speedyeye_open_file(const char *path, char *error, size_t error_size)
+{
+    speedyeye_client *handle = new speedyeye_client;
+    bool ok = handle->client.openFile(path);
+    return finishOpen(handle, ok, error, error_size);
+}
+
+void speedyeye_close(speedyeye_client *client)
+{
+    delete client;
+}
+
+uint32_t speedyeye_num_frames(const speedyeye_client *client)
+{
+    return client->client.numFrames();
+}
+
+uint32_t speedyeye_num_history_frames(const speedyeye_client *client)
+{
+    return client->client.numHistoryFrames();
+}
+
+uint32_t speedyeye_max_points(const speedyeye_client *client)
+{
+    (void) client;
+    return TrackingBuffer::kMaxTrackingPoints;
+}
+
+uint32_t speedyeye_frame_counter(const speedyeye_client *client)
+{
+    return client->client.frameCounter();
+}
+
+int speedyeye_wait_for_frame(speedyeye_client *client, uint32_t index, double timeout)
+{
+    return client->client.waitForFrame(index, timeout);
+}
+
+int speedyeye_is_retired(const speedyeye_client *client)
+{
+    return client->client.isRetired();
+}
+
+int speedyeye_reopen(speedyeye_client *client)
+{
+    return client->client.reopen();
+}
+
+int speedyeye_get_frame(const speedyeye_client *client, uint32_t index, speedyeye_frame *frame)
+{
+    TrackingClient::FrameView f;
+    TrackingClient::PixelsView p;
+
+    int result = client->client.viewFrame(index, f);
+    if (result != SPEEDYEYE_READ_OK) {
+        return result;
+    }
+    result = client->client.viewPixels(index, p);
+    if (result != SPEEDYEYE_READ_OK) {
+        return result;
+    }
+
+    frame->frame_slot = &*f;
+    frame->pixels_slot = &*p;
+    frame->frame_sequence = f.sequence();
+    frame->pixels_sequence = p.sequence();
+
+    frame->frame_index = f->frame_index;
+    frame->timestamp = f->timestamp;
+    frame->timestamp_ns = f->timestamp_ns;
+    frame->num_points = std::min<uint32_t>(f->num_points, TrackingBuffer::kMaxTrackingPoints);
+    frame->motion_x = f->motionX;
+    frame->motion_y = f->motionY;
+
+    frame->x = f->points.x;
+    frame->y = f->points.y;
+    frame->dx = f->points.dx;
+    frame->dy = f->points.dy;
+    frame->weight = f->points.weight;
+    frame->age = f->points.age;
+    frame->link = f->points.link;
+    frame->id = f->points.id;
+
+    frame->pixels = reinterpret_cast<const uint8_t*>(p->pixels);
+    frame->pixels_half = reinterpret_cast<const uint8_t*>(p->pixels_half);
+    frame->pixels_quarter = reinterpret_cast<const uint8_t*>(p->pixels_quarter);
+    frame->width = TrackingBuffer::kWidth;
+    frame->height = TrackingBuffer::kHeight;
+
+    // The copies above came after the views were taken, so make sure they weren't torn
+    return speedyeye_frame_valid(frame) ? SPEEDYEYE_READ_OK : SPEEDYEYE_READ_BUSY;
+}
+
+int speedyeye_frame_valid(const speedyeye_frame *frame)
+{
+    const TrackingBuffer::Frame_t *f = static_cast<const TrackingBuffer::Frame_t*>(frame->frame_slot);
+    const TrackingBuffer::Pixels_t *p = static_cast<const TrackingBuffer::Pixels_t*>(frame->pixels_slot);
+    return f && p && !f->lock.readRetry(frame->frame_sequence) && !p->lock.readRetry(frame->pixels_sequence);
+}
+
+uint32_t speedyeye_read_history(const speedyeye_client *client, uint32_t first, uint32_t count,
+                                speedyeye_history_frame *frames,
+                                speedyeye_history_point *points, uint64_t max_points,
+                                uint64_t *num_points)
+{
+    const TrackingClient& c = client->client;
+    uint64_t used = 0;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        TrackingBuffer::HistoryFrame_t record = {};
+        speedyeye_history_frame& out = frames[i];
+
+        int result = c.readHistoryFrame(first + i, record);
+        if (result == SPEEDYEYE_READ_NOT_READY) {
+            break;
+        }
+
+        uint64_t n = std::min<uint64_t>(record.num_points, c.numHistoryPoints());
+        if (result == SPEEDYEYE_READ_OK && used + n > max_points) {
+            break;
+        }
+
+        out.frame_index = first + i;
+        out.status = result;
+        out.num_points = 0;
+        out.first_point = used;
+
+        if (result == SPEEDYEYE_READ_OK) {
+            out.timestamp = record.timestamp;
+            out.timestamp_ns = record.timestamp_ns;
+            out.motion_x = record.motionX;
+            out.motion_y = record.motionY;
+
+            TrackingBuffer::HistoryPoint_t *dest = reinterpret_cast<TrackingBuffer::HistoryPoint_t*>(points + used);
+            if (c.readHistoryPoints(record, dest)) {
+                out.num_points = uint32_t(n);
+                used += n;
+            } else {
+                out.status = SPEEDYEYE_READ_OVERRUN;
+            }
+        } else {
+            out.timestamp = 0;
+            out.timestamp_ns = 0;
+            out.motion_x = 0;
+            out.motion_y = 0;
+        }
+    }
+
+    if (num_points) {
+        *num_points = used;
+    }
+    return i;
+}
+
+int speedyeye_register(speedyeye_client *client, const char *name)
+{
+    return client->client.registerClient(name);
+}
+
+int speedyeye_report(speedyeye_client *client, uint32_t next_frame, uint64_t consumed,
+                     uint64_t dropped, int64_t timestamp_ns)
+{
+    TrackingClient::Cursor c = client->client.cursor();
+    c.next = next_frame;
+    c.delivered = consumed;
+    c.skipped = dropped;
+    c.timestamp_ns = timestamp_ns;
+    return client->client.report(c);
+}
+
+uint32_t speedyeye_read_clients(const speedyeye_client *client, speedyeye_client_stats *stats,
+                                uint32_t max_clients)
+{
+    std::vector<TrackingBuffer::ClientStats_t> clients;
+    client->client.readClients(clients);
+
+    uint32_t n = std::min<uint32_t>(uint32_t(clients.size()), max_clients);
+    for (uint32_t i = 0; i < n; i++) {
+        const TrackingBuffer::ClientStats_t& from = clients[i];
+        speedyeye_client_stats& to = stats[i];
+        to.owner = from.owner;
+        memcpy(to.name, from.name, sizeof to.name);
+        to.lag = from.lag;
+        to.frames_consumed = from.frames_consumed;
+        to.frames_dropped = from.frames_dropped;
+        to.latency_us = from.latency_us;
+        to.max_latency_us = from.max_latency_us;
+        to.idle_ns = from.idle_ns;
+        to.dead = from.dead;
+    }
+    return n;
+}
+
+int speedyeye_post_command(speedyeye_client *client, uint32_t type, uint32_t param,
+                           double value, uint64_t *ticket)
+{
+    return client->client.postCommand(type, param, value, ticket);
+}
+
+int speedyeye_command_done(const speedyeye_client *client, uint64_t ticket, double *result)
+{
+    return client->client.commandDone(ticket, result);
+}
+
+int speedyeye_claim_region(speedyeye_client *client)
+{
+    return client->client.claimRegion();
+}
+
+void speedyeye_release_region(speedyeye_client *client, int index)
+{
+    if (validRegion(index)) {
+        client->client.releaseRegion(index);
+    }
+}
+
+int speedyeye_set_region_rect(speedyeye_client *client, int index, float x0, float y0, float x1, float y1)
+{
+    if (!validRegion(index)) {
+        return 0;
+    }
+    client->client.setRegionRect(index, x0, y0, x1, y1);
+    return 1;
+}
+
+int speedyeye_set_region_mask(speedyeye_client *client, int index, const uint32_t mask[SPEEDYEYE_REGION_MASK_WORDS])
+{
+    if (!validRegion(index)) {
+        return 0;
+    }
+    client->client.setRegionMask(index, mask);
+    return 1;
+}
+
+int speedyeye_read_region_motion(const speedyeye_client *client, int index, speedyeye_region_motion *motion)
+{
+    if (!validRegion(index)) {
+        return 0;
+    }
+    client->client.readRegionMotion(index, *reinterpret_cast<TrackingBuffer::RegionMotion_t*>(motion));
+    return 1;
+}
+
+int speedyeye_claim_rule(speedyeye_client *client)
+{
+    return client->client.claimRule();
+}
+
+void speedyeye_release_rule(speedyeye_client *client, int index)
+{
+    if (validRule(index)) {
+        client->client.releaseRule(index);
+    }
+}
+
+int speedyeye_set_rule(speedyeye_client *client, int index, const speedyeye_rule *rule)
+{
+    if (!validRule(index)) {
+        return 0;
+    }
+    client->client.setRule(index, *reinterpret_cast<const TrackingBuffer::RuleConfig_t*>(rule));
+    return 1;
+}
+
+uint32_t speedyeye_event_counter(const speedyeye_client *client)
+{
+    return client->client.eventCounter();
+}
+
+int speedyeye_read_event(const speedyeye_client *client, uint32_t index, speedyeye_event *event)
+{
+    TrackingBuffer::Event_t e;
+    int result = client->client.readEvent(index, e);
+    if (result == SPEEDYEYE_READ_OK) {
+        event->event_index = e.event_index;
+        event->rule = e.rule;
+        event->type = e.type;
+        event->frame_index = e.frame_index;
+        event->timestamp = e.timestamp;
+        event->timestamp_ns = e.timestamp_ns;
+        event->motion_x = e.motionX;
+        event->motion_y = e.motionY;
+    }
+    return result;
+}
+
+int speedyeye_wait_for_event(speedyeye_client *client, uint32_t index, double timeout)
+{
+    return client->client.waitForEvent(index, timeout);
+}
+
+speedyeye_video_decoder *speedyeye_video_decoder_new(int format, uint32_t width, uint32_t height)
+{
+    if ((format != SPEEDYEYE_VIDEO_LUMA && format != SPEEDYEYE_VIDEO_YUV422)
+        || !width || !height || (width & 1) || width > 0xFFFF || height > 0xFFFF) {
+        return 0;
+    }
+    return new speedyeye_video_decoder(format, width, height);
+}
+
+void speedyeye_video_decoder_free(speedyeye_video_decoder *decoder)
+{
+    delete decoder;
+}
+
+int speedyeye_video_decode(speedyeye_video_decoder *decoder, const void *header,
+                           const void *payload, size_t payload_size, uint8_t *out)
+{
+    VideoCodec::FrameHeader_t h;
+    memcpy(&h, header, sizeof h);
+    if (h.payload_size != payload_size
+        || !decoder->decoder.decode(h, static_cast<const uint8_t*>(payload))) {
+        return 0;
+    }
+
+    if (decoder->format == SPEEDYEYE_VIDEO_YUV422) {
+        decoder->decoder.toYuyv(out);
+    } else {
+        memcpy(out, decoder->decoder.planes(), decoder->decoder.size());
+    }
+    return 1;
+}
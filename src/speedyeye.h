@@ -0,0 +1,281 @@
+/* C interface for SpeedyEye tracking buffer clients (c) 2015 Micah Elizabeth Scott
+ * MIT license
+ *
+ * A thin layer over TrackingClient for other languages. Frames are returned as pointers
+ * into the shared ring; nothing is copied. The producer may overwrite a frame at any time
+ * once the ring wraps, so read what you need and then check speedyeye_frame_valid().
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define SPEEDYEYE_API __declspec(dllexport)
+#else
+#define SPEEDYEYE_API __attribute__((visibility("default")))
+#endif
+
+/* Results from speedyeye_get_frame(), and the status of each history frame */
+enum {
+    SPEEDYEYE_READ_OK,              /* Consistent frame */
+    SPEEDYEYE_READ_NOT_READY,       /* Frame hasn't been published yet */
+    SPEEDYEYE_READ_OVERRUN,         /* Ring has wrapped and the slot now holds a newer frame */
+    SPEEDYEYE_READ_BUSY,            /* Slot kept changing underneath us; try again later */
+};
+
+typedef struct speedyeye_client speedyeye_client;
+
+typedef struct {
+    uint32_t frame_index;
+    double timestamp;               /* Seconds since the producer started */
+    int64_t timestamp_ns;           /* Monotonic clock at capture */
+    uint32_t num_points;
+    float motion_x, motion_y;
+
+    /* Tracking points, num_points of each, in shared memory */
+    const float *x, *y;
+    const float *dx, *dy;
+    const float *weight;
+    const uint32_t *age;
+    const uint32_t *link;
+    const uint64_t *id;
+
+    /* Images in shared memory, 4 bytes per pixel (blue, green, red, luminance), rows packed */
+    const uint8_t *pixels;          /* width x height */
+    const uint8_t *pixels_half;     /* width/2 x height/2 */
+    const uint8_t *pixels_quarter;  /* width/4 x height/4 */
+    uint32_t width, height;
+
+    /* Private, for speedyeye_frame_valid() */
+    const void *frame_slot, *pixels_slot;
+    uint32_t frame_sequence, pixels_sequence;
+} speedyeye_frame;
+
+typedef struct {
+    uint32_t frame_index;
+    int32_t status;                 /* SPEEDYEYE_READ_* */
+    double timestamp;
+    int64_t timestamp_ns;
+    float motion_x, motion_y;
+    uint32_t num_points;            /* Point records copied for this frame */
+    uint64_t first_point;           /* Position of its first record in the output array */
+} speedyeye_history_frame;
+
+typedef struct {
+    uint64_t id;                    /* Track ID */
+    float x, y;
+} speedyeye_history_point;
+
+typedef struct {
+    uint32_t owner;                 /* Usually a process ID */
+    char name[16];
+    uint32_t lag;                   /* Frames published that it hasn't read yet */
+    uint64_t frames_consumed;
+    uint64_t frames_dropped;        /* Lost to ring wrap before it read them */
+    uint32_t latency_us;            /* Capture to consumption, for its latest frame */
+    uint32_t max_latency_us;
+    int64_t idle_ns;                /* Time since its last report */
+    int dead;                       /* Stopped reporting */
+} speedyeye_client_stats;
+
+/* Map a tracking buffer by shared memory name (NULL for the default), or a --file buffer.
+ * Returns NULL on failure, with a description in error if there's room for it. */
+SPEEDYEYE_API speedyeye_client *speedyeye_open(const char *name, char *error, size_t error_size);
+SPEEDYEYE_API speedyeye_client *speedyeye_open_file(const char *path, char *error, size_t error_size);
+SPEEDYEYE_API void speedyeye_close(speedyeye_client *client);
+
+/* Ring sizes and limits from the buffer's header */
+SPEEDYEYE_API uint32_t speedyeye_num_frames(const speedyeye_client *client);
+SPEEDYEYE_API uint32_t speedyeye_num_history_frames(const speedyeye_client *client);
+SPEEDYEYE_API uint32_t speedyeye_max_points(const speedyeye_client *client);
+
+/* Number of frames published so far. The latest frame is one less. */
+SPEEDYEYE_API uint32_t speedyeye_frame_counter(const speedyeye_client *client);
+
+/* Sleep until the frame with this index has been published, or the timeout in seconds
+ * elapses. Returns nonzero if the frame is available. */
+SPEEDYEYE_API int speedyeye_wait_for_frame(speedyeye_client *client, uint32_t index, double timeout);
+
+/* Has the producer replaced this buffer with a new one? If so, no more frames will arrive
+ * and speedyeye_wait_for_frame() returns zero right away. speedyeye_reopen() maps the new
+ * buffer by the same name or path, invalidating any frames from the old one. It returns
+ * zero, keeping the old mapping, if the new buffer isn't there yet. */
+SPEEDYEYE_API int speedyeye_is_retired(const speedyeye_client *client);
+SPEEDYEYE_API int speedyeye_reopen(speedyeye_client *client);
+
+/* Point a speedyeye_frame at a published frame. Returns SPEEDYEYE_READ_*; the frame is
+ * only filled in on SPEEDYEYE_READ_OK. */
+SPEEDYEYE_API int speedyeye_get_frame(const speedyeye_client *client, uint32_t index, speedyeye_frame *frame);
+
+/* Has everything read through this frame so far been intact? */
+SPEEDYEYE_API int speedyeye_frame_valid(const speedyeye_frame *frame);
+
+/* Copy up to count consecutive frames from the history ring, starting at first, with
+ * their point records. Stops early at the first unpublished frame, or before a frame
+ * whose points wouldn't fit in max_points. Frames already gone from the ring, or whose
+ * points have expired, are included with status SPEEDYEYE_READ_OVERRUN and no points.
+ * Returns the number of frames written, and the number of points in *num_points. */
+SPEEDYEYE_API uint32_t speedyeye_read_history(const speedyeye_client *client, uint32_t first, uint32_t count,
+                                              speedyeye_history_frame *frames,
+                                              speedyeye_history_point *points, uint64_t max_points,
+                                              uint64_t *num_points);
+
+/* Join the buffer's client registry under this name, so the producer and monitors can see
+ * how far behind we are. Returns nonzero on success, zero if the registry is full. */
+SPEEDYEYE_API int speedyeye_register(speedyeye_client *client, const char *name);
+
+/* Report progress, and serve as a heartbeat: the next frame index we'll read, our running
+ * totals of frames read and dropped, and the capture timestamp_ns of the last frame read
+ * (zero if none). Returns zero if we aren't registered. */
+SPEEDYEYE_API int speedyeye_report(speedyeye_client *client, uint32_t next_frame, uint64_t consumed,
+                                   uint64_t dropped, int64_t timestamp_ns);
+
+/* Snapshot up to max_clients registered clients. Returns the number written. */
+SPEEDYEYE_API uint32_t speedyeye_read_clients(const speedyeye_client *client, speedyeye_client_stats *stats,
+                                              uint32_t max_clients);
+
+/* Commands for the producer, run in order once per frame */
+enum {
+    SPEEDYEYE_COMMAND_SET_CONTROL = 1,  /* param: SPEEDYEYE_CONTROL_*. Result: the value actually applied */
+    SPEEDYEYE_COMMAND_RESET_MOTION,     /* Zero the integrated motion. Result: 0 */
+    SPEEDYEYE_COMMAND_RESET_POINTS,     /* Drop all tracking points on the next frame. Result: 0 */
+    SPEEDYEYE_COMMAND_SNAPSHOT,         /* Save the next frame as an image. Result: its frame_counter */
+};                                      /* Unknown commands have a result of -1 */
+
+/* Settings for SPEEDYEYE_COMMAND_SET_CONTROL */
+enum {
+    SPEEDYEYE_CONTROL_MIN_POINT_QUALITY,
+    SPEEDYEYE_CONTROL_AUTOGAIN,
+    SPEEDYEYE_CONTROL_GAIN,
+    SPEEDYEYE_CONTROL_EXPOSURE,
+    SPEEDYEYE_CONTROL_SHARPNESS,
+    SPEEDYEYE_CONTROL_HUE,
+    SPEEDYEYE_CONTROL_AUTO_WHITE_BALANCE,
+    SPEEDYEYE_CONTROL_BRIGHTNESS,
+    SPEEDYEYE_CONTROL_CONTRAST,
+    SPEEDYEYE_CONTROL_BLUE_BALANCE,
+    SPEEDYEYE_CONTROL_RED_BALANCE,
+    SPEEDYEYE_CONTROL_FLIP_H,
+    SPEEDYEYE_CONTROL_FLIP_V,
+};
+
+/* Queue a command for the producer. Returns zero if the queue is full. If ticket isn't
+ * NULL, it receives an identifier for speedyeye_command_done(). */
+SPEEDYEYE_API int speedyeye_post_command(speedyeye_client *client, uint32_t type, uint32_t param,
+                                         double value, uint64_t *ticket);
+
+/* Has the producer run this command? Returns nonzero if it has, and if result isn't NULL
+ * and the result is still remembered, stores it there. */
+SPEEDYEYE_API int speedyeye_command_done(const speedyeye_client *client, uint64_t ticket, double *result);
+
+/* Regions of the image with their own integrated motion. A region is a rectangle, or a
+ * mask with one bit for each square cell of SPEEDYEYE_REGION_CELL_SIZE pixels. Cells are
+ * numbered in rows of SPEEDYEYE_REGION_MASK_WIDTH, cell c being bit c % 32 of word c / 32. */
+enum {
+    SPEEDYEYE_MAX_REGIONS = 16,
+    SPEEDYEYE_REGION_CELL_SIZE = 5,
+    SPEEDYEYE_REGION_MASK_WIDTH = 64,
+    SPEEDYEYE_REGION_MASK_WORDS = 96,
+};
+
+typedef struct {
+    uint32_t frame_index;
+    uint32_t num_points;            /* Tracked points inside the region */
+    float motion_x, motion_y;       /* Weighted mean of their motion */
+    float total_x, total_y;         /* Integrated since the region was last described */
+} speedyeye_region_motion;
+
+/* Claim a free region, owned by this process. Returns its index, or -1 if all are in use.
+ * Regions aren't reclaimed from clients that exit without releasing them. */
+SPEEDYEYE_API int speedyeye_claim_region(speedyeye_client *client);
+SPEEDYEYE_API void speedyeye_release_region(speedyeye_client *client, int index);
+
+/* Describe a claimed region, restarting its totals. Return zero if the index is invalid. */
+SPEEDYEYE_API int speedyeye_set_region_rect(speedyeye_client *client, int index,
+                                            float x0, float y0, float x1, float y1);
+SPEEDYEYE_API int speedyeye_set_region_mask(speedyeye_client *client, int index,
+                                            const uint32_t mask[SPEEDYEYE_REGION_MASK_WORDS]);
+
+/* Consistent copy of a region's latest motion. Returns zero if the index is invalid. */
+SPEEDYEYE_API int speedyeye_read_region_motion(const speedyeye_client *client, int index,
+                                               speedyeye_region_motion *motion);
+
+/* Rules the producer checks on every frame, firing events into a ring as the speed of the
+ * whole frame's motion, or of one region's, crosses a threshold */
+enum {
+    SPEEDYEYE_MAX_RULES = 32,
+    SPEEDYEYE_EVENT_RING_SIZE = 256,
+};
+
+/* Event types, as bits for speedyeye_rule.events */
+enum {
+    SPEEDYEYE_EVENT_START = 1 << 0,     /* Speed reached threshold */
+    SPEEDYEYE_EVENT_STOP = 1 << 1,      /* Speed fell below threshold - hysteresis */
+    SPEEDYEYE_EVENT_DIRECTION = 1 << 2, /* While started, motion moved to another 45 degree sector */
+};
+
+typedef struct {
+    uint32_t events;                /* SPEEDYEYE_EVENT_* bits to fire, zero if the rule is off */
+    int32_t region;                 /* Region to watch, or -1 for the whole frame */
+    float threshold;                /* Pixels per frame */
+    float hysteresis;
+    uint32_t debounce;              /* Frames a change must last before its event fires */
+} speedyeye_rule;
+
+typedef struct {
+    uint32_t event_index;
+    uint32_t rule;
+    uint32_t type;                  /* SPEEDYEYE_EVENT_* */
+    uint32_t frame_index;           /* Frame the event was detected on */
+    double timestamp;               /* That frame's timestamps */
+    int64_t timestamp_ns;
+    float motion_x, motion_y;       /* Motion the rule saw on that frame */
+} speedyeye_event;
+
+/* Claim a free rule, owned by this process. Returns its index, or -1 if all are in use.
+ * Like regions, rules aren't reclaimed from clients that exit without releasing them. */
+SPEEDYEYE_API int speedyeye_claim_rule(speedyeye_client *client);
+SPEEDYEYE_API void speedyeye_release_rule(speedyeye_client *client, int index);
+
+/* Configure a claimed rule, which starts over in the stopped state. Returns zero if the
+ * index is invalid. */
+SPEEDYEYE_API int speedyeye_set_rule(speedyeye_client *client, int index, const speedyeye_rule *rule);
+
+/* Number of events published so far. The latest event is one less. */
+SPEEDYEYE_API uint32_t speedyeye_event_counter(const speedyeye_client *client);
+
+/* Copy a published event. Returns SPEEDYEYE_READ_*; the event is only filled in on
+ * SPEEDYEYE_READ_OK. */
+SPEEDYEYE_API int speedyeye_read_event(const speedyeye_client *client, uint32_t index, speedyeye_event *event);
+
+/* Sleep until the event with this index has been published, or the timeout in seconds
+ * elapses. Returns nonzero if the event is available. */
+SPEEDYEYE_API int speedyeye_wait_for_event(speedyeye_client *client, uint32_t index, double timeout);
+
+/* Video stream formats, from the stream header sent by SpeedyEye's --video server */
+enum {
+    SPEEDYEYE_VIDEO_LUMA,           /* Luminance only, width x height bytes */
+    SPEEDYEYE_VIDEO_YUV422,         /* Packed YUYV, width x height x 2 bytes */
+};
+
+/* Decodes the frames of one video stream, described in src/VideoCodec.h. Every frame
+ * depends on the last, so feed each decoder all of its stream's frames in order. */
+typedef struct speedyeye_video_decoder speedyeye_video_decoder;
+
+SPEEDYEYE_API speedyeye_video_decoder *speedyeye_video_decoder_new(int format, uint32_t width, uint32_t height);
+SPEEDYEYE_API void speedyeye_video_decoder_free(speedyeye_video_decoder *decoder);
+
+/* Decode a frame from its 32-byte header and the payload_size bytes after it, writing the
+ * image to out in the stream's format. Returns zero if the frame is corrupt or the decoder
+ * is waiting for a keyframe. */
+SPEEDYEYE_API int speedyeye_video_decode(speedyeye_video_decoder *decoder, const void *header,
+                                         const void *payload, size_t payload_size, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,8 +8,20 @@ static const int ITUR_BT_601_CVG = -852492;
 static const int ITUR_BT_601_CVR = 1673527;
 static const int ITUR_BT_601_SHIFT = 20;
 
-static void yuv422_to_rgbl(const uint8_t *yuv_src, const int stride, uint8_t *dst, const int width, const int height)
+// Converts to 32-bit pixels with luminance in the high byte. If luma_histogram is non-NULL,
+// a 256-bin histogram of the Y channel is accumulated during the same pass.
+//
+// The kernel is specialized on image size. With kWidth and kHeight known at compile time,
+// the row loop has a constant trip count and the destination a constant row stride;
+// zero means the size is only known at runtime.
+
+template <int kWidth, int kHeight>
+static void yuv422_to_rgbl_sized(const uint8_t *yuv_src, const int stride, uint8_t *dst, int width, int height,
+                                 uint32_t *luma_histogram)
 {
+    if (kWidth) width = kWidth;
+    if (kHeight) height = kHeight;
+
     const int bIdx = 0;
     const int uIdx = 0;
     const int yIdx = 0;
@@ -18,6 +30,11 @@ static void yuv422_to_rgbl(const uint8_t *yuv_src, const int stride, uint8_t *ds
     const int vidx = (2 + uidx) % 4;
     int j, i;
 
+    // Even and odd pixels count into separate tables, so that neighboring pixels with
+    // the same luma don't serialize on a single load-increment-store.
+    uint32_t hist_even[256] = {0};
+    uint32_t hist_odd[256] = {0};
+
     #define _max(a, b) (((a) > (b)) ? (a) : (b)) 
     #define _saturate(v) static_cast<uint8_t>(static_cast<uint32_t>(v) <= 0xff ? v : v > 0 ? 0xff : 0)
 
@@ -40,6 +57,7 @@ static void yuv422_to_rgbl(const uint8_t *yuv_src, const int stride, uint8_t *ds
             row[1]      = _saturate((y00 + guv) >> ITUR_BT_601_SHIFT);
             row[bIdx]   = _saturate((y00 + buv) >> ITUR_BT_601_SHIFT);
             row[3]      = cy00;
+            hist_even[cy00]++;
 
             uint8_t cy01 = yuv_src[i + yIdx + 2];
             int y01 = _max(0, static_cast<int>(cy01) - 16) * ITUR_BT_601_CY;
@@ -47,9 +65,29 @@ static void yuv422_to_rgbl(const uint8_t *yuv_src, const int stride, uint8_t *ds
             row[5]      = _saturate((y01 + guv) >> ITUR_BT_601_SHIFT);
             row[4+bIdx] = _saturate((y01 + buv) >> ITUR_BT_601_SHIFT);
             row[7]      = cy01;
+            hist_odd[cy01]++;
+        }
+    }
+
+    if (luma_histogram) {
+        for (i = 0; i < 256; i++) {
+            luma_histogram[i] = hist_even[i] + hist_odd[i];
         }
     }
 
     #undef _max
     #undef _saturate
 }
+
+// Picks the specialization for the camera's QVGA mode, the only one TrackingBuffer is sized
+// for, falling back to a generic kernel
+
+static inline void yuv422_to_rgbl(const uint8_t *yuv_src, const int stride, uint8_t *dst, const int width, const int height,
+                           uint32_t *luma_histogram = 0)
+{
+    if (width == 320 && height == 240) {
+        yuv422_to_rgbl_sized<320, 240>(yuv_src, stride, dst, width, height, luma_histogram);
+    } else {
+        yuv422_to_rgbl_sized<0, 0>(yuv_src, stride, dst, width, height, luma_histogram);
+    }
+}